@@ -0,0 +1,435 @@
+// Throughput benchmark for the link layer, without a serial cable.
+// Both ends run in this process on the two pseudo-terminals of a relay
+// thread, which carries the bytes at the baudrate of the run (10 bits per
+// byte), flips bytes at the byte error rate of the run and delays them by
+// the delay of the run. For every combination of maximum payload, baudrate,
+// error rate and delay, random data goes through llwrite() / llread() with
+// the settings the application uses and one CSV line is printed: goodput,
+// efficiency (payload bits / line bits) and CPU time of both ends per MB.
+// Sweeps may be given as comma separated lists:
+//   bench_link [-p payloads] [-b baudrates] [-e error rates] [-d delays (ms)] [-t seconds] [-v]
+// The link layer's own output is dropped unless -v is given.
+
+#define _GNU_SOURCE
+#include "link_layer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SWEEP 16
+#define RUN_SECONDS 4 // Line time of the data sent per run, at the run's baudrate
+
+// Link settings, as the application sets them
+#define N_TRIES 3
+#define TIMEOUT 4
+#define WINDOW_SIZE 4
+#define FEC_PARITY 32
+
+// Relay: bytes read from one pseudo-terminal wait in CHUNKS chunks of up
+// to CHUNK_SIZE bytes until their delay is over and the line is free
+#define CHUNK_SIZE 512
+#define CHUNKS 4096
+
+static int payloads[MAX_SWEEP] = {1024, 8192};
+static int bauds[MAX_SWEEP] = {38400, 115200};
+static double errorRates[MAX_SWEEP] = {0, 1e-3};
+static double delays[MAX_SWEEP] = {0, 20};
+static int nPayloads = 2, nBauds = 2, nErrorRates = 2, nDelays = 2;
+static int runSeconds = RUN_SECONDS;
+
+typedef struct
+{
+    int64_t release; // When its delay is over (us)
+    int len;
+    int off;         // Bytes already written
+    unsigned char data[CHUNK_SIZE];
+} Chunk;
+
+// One direction of the relay
+typedef struct
+{
+    int from;
+    int to;
+    Chunk *chunks;
+    unsigned head; // Next chunk to write
+    unsigned tail; // Next chunk to fill
+    double credit; // Bytes the line may carry now
+    int64_t last;
+} Direction;
+
+typedef struct
+{
+    int master[2];
+    char slave[2][50];
+    int baud;
+    double errorRate;
+    int64_t delay;
+    uint64_t rng;
+    atomic_int stop;
+} Relay;
+
+typedef struct
+{
+    Relay *relay;
+    int payload;
+    const unsigned char *data;
+    int size;
+    unsigned char *received;
+    int64_t start; // First llwrite() (us)
+    int64_t end;   // Last byte delivered by llread() (us)
+    double txCpu;  // Seconds of CPU of each end
+    double rxCpu;
+    unsigned long retransmissions;
+    int txResult;
+    int rxResult;
+} Run;
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double thread_cpu()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double rng_next(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return (*s * 0x2545F4914F6CDD1DULL >> 11) / 9007199254740992.0;
+}
+
+// Take what the pseudo-terminal has into a new chunk, flipping bytes
+static void relay_read(Relay *r, Direction *d)
+{
+    if (d->tail - d->head == CHUNKS)
+        return;
+    Chunk *c = &d->chunks[d->tail % CHUNKS];
+    int n = read(d->from, c->data, CHUNK_SIZE);
+    if (n <= 0)
+        return;
+    if (r->errorRate > 0)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            if (rng_next(&r->rng) < r->errorRate)
+                c->data[i] ^= 0xFF;
+        }
+    }
+    c->release = now_us() + r->delay;
+    c->len = n;
+    c->off = 0;
+    d->tail++;
+}
+
+// Write what the line may carry by now. Returns 1 while bytes wait.
+static int relay_write(Relay *r, Direction *d)
+{
+    int64_t now = now_us();
+    double max = r->baud / 10 * 0.005;
+    if (max < 64)
+        max = 64;
+    d->credit += (now - d->last) * r->baud / 10 / 1e6;
+    if (d->credit > max)
+        d->credit = max;
+    d->last = now;
+
+    while (d->head != d->tail)
+    {
+        Chunk *c = &d->chunks[d->head % CHUNKS];
+        if (c->release > now)
+            return 1;
+        int n = c->len - c->off;
+        if (n > (int)d->credit)
+            n = (int)d->credit;
+        if (n == 0)
+            return 1;
+        int w = write(d->to, c->data + c->off, n);
+        if (w <= 0)
+            return 1;
+        d->credit -= w;
+        c->off += w;
+        if (c->off < c->len)
+            return 1;
+        d->head++;
+    }
+    return 0;
+}
+
+static void *relay_thread(void *arg)
+{
+    Relay *r = arg;
+    Direction dirs[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        dirs[i].from = r->master[i];
+        dirs[i].to = r->master[1 - i];
+        dirs[i].chunks = malloc(CHUNKS * sizeof(Chunk));
+        dirs[i].head = dirs[i].tail = 0;
+        dirs[i].credit = 0;
+        dirs[i].last = now_us();
+    }
+    while (!atomic_load(&r->stop))
+    {
+        int waiting = 0;
+        for (int i = 0; i < 2; ++i)
+            waiting |= relay_write(r, &dirs[i]);
+        struct pollfd fds[2] = {{r->master[0], POLLIN, 0}, {r->master[1], POLLIN, 0}};
+        if (poll(fds, 2, waiting ? 1 : 10) <= 0)
+            continue;
+        for (int i = 0; i < 2; ++i)
+        {
+            if (fds[i].revents & POLLIN)
+                relay_read(r, &dirs[i]);
+        }
+    }
+    free(dirs[0].chunks);
+    free(dirs[1].chunks);
+    return NULL;
+}
+
+// Open a pseudo-terminal pair: the relay keeps the master, a link opens
+// the slave by its name. Returns 0 on success or -1 on error.
+static int open_pty(int *master, char *slave, int size)
+{
+    *master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (*master < 0)
+        return -1;
+    if (grantpt(*master) < 0 || unlockpt(*master) < 0 || ptsname_r(*master, slave, size) != 0)
+    {
+        close(*master);
+        return -1;
+    }
+    return 0;
+}
+
+static LinkLayer link_settings(const char *port, LinkLayerRole role, int baud, int payload)
+{
+    LinkLayer ll;
+    memset(&ll, 0, sizeof(ll));
+    snprintf(ll.serialPort, sizeof(ll.serialPort), "%s", port);
+    ll.role = role;
+    ll.baudRate = baud;
+    ll.nRetransmissions = N_TRIES;
+    ll.timeout = TIMEOUT;
+    ll.windowSize = WINDOW_SIZE;
+    ll.fcs = LlFcsCrc32c;
+    ll.maxPayloadSize = payload;
+    ll.scramble = 1;
+    ll.fec = FEC_PARITY;
+    ll.adaptive = 1;
+    return ll;
+}
+
+static void *tx_thread(void *arg)
+{
+    Run *run = arg;
+    double cpu = thread_cpu();
+    ll_ctx *link = llopen_ctx(link_settings(run->relay->slave[0], LlTx, run->relay->baud, run->payload));
+    if (!link)
+        return NULL;
+    run->start = now_us();
+    int sent = 0;
+    run->txResult = 0;
+    while (sent < run->size)
+    {
+        // Frames as long as the link asks for, as the application sends them
+        int n = llpayload_ctx(link);
+        if (n > run->size - sent)
+            n = run->size - sent;
+        if (llwrite_ctx(link, run->data + sent, n) < 0)
+        {
+            run->txResult = -1;
+            break;
+        }
+        sent += n;
+    }
+    LinkLayerStats stats;
+    llstats_ctx(link, &stats);
+    run->retransmissions = stats.retransmissions;
+    if (llclose_ctx(link) < 0)
+        run->txResult = -1;
+    run->txCpu = thread_cpu() - cpu;
+    return NULL;
+}
+
+static void *rx_thread(void *arg)
+{
+    Run *run = arg;
+    double cpu = thread_cpu();
+    ll_ctx *link = llopen_ctx(link_settings(run->relay->slave[1], LlRx, run->relay->baud, run->payload));
+    if (!link)
+        return NULL;
+    unsigned char *packet = malloc(llmaxpayload_ctx(link));
+    int received = 0;
+    int64_t lastPacket = now_us();
+    run->rxResult = 0;
+    while (received < run->size)
+    {
+        int n = lltryread_ctx(link, packet);
+        if (n < 0 || received + n > run->size)
+        {
+            run->rxResult = -1;
+            break;
+        }
+        if (n == 0)
+        {
+            // Give up after as long as the transmitter tries a frame
+            if (now_us() - lastPacket > (int64_t)(N_TRIES + 1) * TIMEOUT * 1000000)
+            {
+                run->rxResult = -1;
+                break;
+            }
+            llwait_ctx(&link, 1, 100);
+            continue;
+        }
+        memcpy(run->received + received, packet, n);
+        received += n;
+        lastPacket = now_us();
+    }
+    run->end = now_us();
+    free(packet);
+    llclose_ctx(link);
+    run->rxCpu = thread_cpu() - cpu;
+    return NULL;
+}
+
+// Run one combination and print its CSV line
+static void bench(FILE *csv, int payload, int baud, double errorRate, double delayMs)
+{
+    Relay relay;
+    memset(&relay, 0, sizeof(relay));
+    relay.baud = baud;
+    relay.errorRate = errorRate;
+    relay.delay = (int64_t)(delayMs * 1000);
+    relay.rng = 0x9E3779B97F4A7C15ULL;
+    if (open_pty(&relay.master[0], relay.slave[0], sizeof(relay.slave[0])) < 0 ||
+        open_pty(&relay.master[1], relay.slave[1], sizeof(relay.slave[1])) < 0)
+    {
+        perror("posix_openpt");
+        exit(1);
+    }
+
+    Run run;
+    memset(&run, 0, sizeof(run));
+    run.relay = &relay;
+    run.payload = payload;
+    run.size = baud / 10 * runSeconds;
+    unsigned char *data = malloc(run.size);
+    run.received = malloc(run.size);
+    uint64_t seed = 12345;
+    for (int i = 0; i < run.size; ++i)
+        data[i] = (unsigned char)(rng_next(&seed) * 256);
+    run.data = data;
+    run.txResult = run.rxResult = -1;
+
+    pthread_t relayThread, txThread, rxThread;
+    pthread_create(&relayThread, NULL, relay_thread, &relay);
+    pthread_create(&rxThread, NULL, rx_thread, &run);
+    pthread_create(&txThread, NULL, tx_thread, &run);
+    pthread_join(txThread, NULL);
+    pthread_join(rxThread, NULL);
+    atomic_store(&relay.stop, 1);
+    pthread_join(relayThread, NULL);
+    close(relay.master[0]);
+    close(relay.master[1]);
+
+    const char *result = "ok";
+    if (run.txResult < 0 || run.rxResult < 0)
+        result = "failed";
+    else if (memcmp(data, run.received, run.size) != 0)
+        result = "corrupt";
+    double seconds = (run.end - run.start) / 1e6;
+    double goodput = strcmp(result, "ok") == 0 && seconds > 0 ? run.size * 8 / seconds : 0;
+    fprintf(csv, "%d,%d,%g,%g,%d,%.3f,%.0f,%.4f,%.4f,%lu,%s\n", payload, baud, errorRate, delayMs,
+            run.size, seconds, goodput, goodput / baud, (run.txCpu + run.rxCpu) / (run.size / 1e6),
+            run.retransmissions, result);
+    fflush(csv);
+    free(data);
+    free(run.received);
+}
+
+// Parse a comma separated list into at most MAX_SWEEP values
+static int parse_ints(const char *s, int *out)
+{
+    int n = 0;
+    for (char *end; *s && n < MAX_SWEEP; s = *end ? end + 1 : end)
+        out[n++] = (int)strtol(s, &end, 10);
+    return n;
+}
+
+static int parse_doubles(const char *s, double *out)
+{
+    int n = 0;
+    for (char *end; *s && n < MAX_SWEEP; s = *end ? end + 1 : end)
+        out[n++] = strtod(s, &end);
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:b:e:d:t:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            nPayloads = parse_ints(optarg, payloads);
+            break;
+        case 'b':
+            nBauds = parse_ints(optarg, bauds);
+            break;
+        case 'e':
+            nErrorRates = parse_doubles(optarg, errorRates);
+            break;
+        case 'd':
+            nDelays = parse_doubles(optarg, delays);
+            break;
+        case 't':
+            runSeconds = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-p payloads] [-b baudrates] [-e error rates] [-d delays (ms)] "
+                            "[-t seconds] [-v]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // The CSV goes to the original stdout; the link layer prints to stdout too
+    FILE *csv = fdopen(dup(STDOUT_FILENO), "w");
+    if (!csv || (!verbose && !freopen("/dev/null", "w", stdout)))
+    {
+        perror("stdout");
+        return 1;
+    }
+    fprintf(csv, "max_payload,baud,byte_error_rate,delay_ms,bytes,seconds,goodput_bps,efficiency,"
+                 "cpu_s_per_mb,retransmissions,result\n");
+    for (int p = 0; p < nPayloads; ++p)
+        for (int b = 0; b < nBauds; ++b)
+            for (int e = 0; e < nErrorRates; ++e)
+                for (int d = 0; d < nDelays; ++d)
+                    bench(csv, payloads[p], bauds[b], errorRates[e], delays[d]);
+    fclose(csv);
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Microbenchmark for the byte stuffing kernels.
+// Runs stuffBytes() / destuffBytes() / stuffFit() with every kernel the CPU supports over
+// random, clean (no FLAG / ESC) and worst-case (all FLAG) payloads, checks the
+// output against the scalar kernel and prints the throughput in MB/s.
+
+#include "stuffing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TOTAL_BYTES (64L * 1024 * 1024) // Processed per measurement
+
+static const char *kernels[] = {"scalar", "sse2", "avx2"};
+static const int sizes[] = {64, 1000, 8192, 65536};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(unsigned char *buf, int len, const char *pattern)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        if (strcmp(pattern, "random") == 0)
+            buf[i] = (unsigned char)rand();
+        else if (strcmp(pattern, "clean") == 0)
+            buf[i] = (unsigned char)(rand() % 0x7D);
+        else
+            buf[i] = FLAG;
+    }
+}
+
+int main()
+{
+    const char *patterns[] = {"random", "clean", "all-flag"};
+    int maxSize = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    unsigned char *in = malloc(maxSize);
+    unsigned char *stuffed = malloc(2 * maxSize);
+    unsigned char *expected = malloc(2 * maxSize);
+    unsigned char *out = malloc(maxSize);
+
+    srand(1);
+    printf("%-8s %-9s %6s %12s %12s %12s\n", "kernel", "payload", "size", "stuff MB/s", "destuff MB/s",
+           "fit MB/s");
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        {
+            int len = sizes[s];
+            fill(in, len, patterns[p]);
+
+            setStuffingKernel("scalar");
+            uint8_t expectedBcc = 0;
+            int expectedLen = stuffBytes(in, len, expected, 2 * len, &expectedBcc);
+            // Fit to the clean size: with any escapes, part of the input is left over
+            int expectedFit = stuffFit(in, len, len);
+
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+            {
+                if (setStuffingKernel(kernels[k]) < 0)
+                    continue;
+
+                uint8_t bcc = 0;
+                int slen = stuffBytes(in, len, stuffed, 2 * len, &bcc);
+                int dlen = destuffBytes(stuffed, slen, out, len);
+                if (slen != expectedLen || bcc != expectedBcc ||
+                    memcmp(stuffed, expected, slen) != 0 ||
+                    dlen != len || memcmp(out, in, len) != 0 || stuffFit(in, len, len) != expectedFit ||
+                    stuffBytes(in, expectedFit, stuffed, len, NULL) < 0 ||
+                    (expectedFit < len && stuffBytes(in, expectedFit + 1, stuffed, len, NULL) >= 0))
+                {
+                    fprintf(stderr, "%s kernel mismatch (%s, %d bytes)\n", kernels[k], patterns[p], len);
+                    return 1;
+                }
+
+                long iterations = TOTAL_BYTES / len;
+                double t0 = now();
+                for (long i = 0; i < iterations; ++i)
+                    stuffBytes(in, len, stuffed, 2 * len, &bcc);
+                double t1 = now();
+                for (long i = 0; i < iterations; ++i)
+                    destuffBytes(stuffed, slen, out, len);
+                double t2 = now();
+                for (long i = 0; i < iterations; ++i)
+                    stuffFit(in, len, len);
+                double t3 = now();
+
+                double mb = (double)iterations * len / 1e6;
+                printf("%-8s %-9s %6d %12.0f %12.0f %12.0f\n", kernels[k], patterns[p], len,
+                       mb / (t1 - t0), mb / (t2 - t1), mb / (t3 - t2));
+            }
+        }
+    }
+
+    free(in);
+    free(stuffed);
+    free(expected);
+    free(out);
+    return 0;
+}
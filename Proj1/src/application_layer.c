@@ -2,28 +2,274 @@
 
 #include "application_layer.h"
 #include "link_layer.h"
+#include "delta.h"
+#include "compress.h"
+#include "spsc_queue.h"
+#include "write_behind.h"
+#include "checkpoint.h"
+#include "hash.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <arpa/inet.h>
-#include <stdbool.h> 
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
 
 #define DATA_PACKET 1
 #define START_PACKET 2
 #define END_PACKET 3
+#define DATA_OFFSET_PACKET 4
+#define SIGNATURE_PACKET 5
+#define COPY_PACKET 6
+#define RESUME_PACKET 7
+#define MANIFEST_PACKET 8
+
+// Set in C of a data packet whose data field is compressed (compress.h);
+// L2 L1 then give the compressed length
+#define COMPRESSED_FLAG 0x80
 
 #define MAX_FILENAME_LEN 255
 
-static int build_control_packet(unsigned char *packet, int controlField, const char *filename, uint32_t fileSize)
+// I-frames in flight before waiting for an RR (1 = stop-and-wait)
+#define WINDOW_SIZE 4
+
+// Frame check sequence proposed to the receiver
+#define FCS_MODE LlFcsCrc32c
+
+// XOR each I-frame with the key byte that leaves the fewest FLAG / ESC to
+// escape (when the receiver agrees), which bounds stuffing to 1/128
+#define SCRAMBLE 1
+
+// Reed-Solomon check bytes per 255-byte codeword of every I-frame, to
+// correct half as many wrong bytes per codeword at the receiver instead of
+// retransmitting the frame (0 = none; even, up to RS_MAX_PARITY)
+#define FEC_PARITY 32
+
+// Hybrid ARQ: the transmitter picks the check bytes (up to FEC_PARITY) and
+// the frame size for the byte error rate it sees, so frames are large and
+// bare on a clean line and short and protected on a noisy one. Frame sizes
+// follow it through FRAME_FIT.
+#define HYBRID_ARQ 1
+
+// Data packet header: C, N, L2, L1
+#define DATA_HEADER_SIZE 4
+#define MAX_DATA_SIZE 65535
+
+// Data packet with offset header: C, offset (4 bytes, big-endian), L2, L1.
+// Sent for every data block, so packets can be placed wherever they land:
+// striped across bonded links, around copied blocks or after a resume.
+// Plain data packets are still accepted from older transmitters.
+#define OFFSET_HEADER_SIZE 7
+
+// Serial ports that can be bonded into one transfer, given as a comma
+// separated list (e.g. /dev/ttyS10,/dev/ttyS11)
+#define MAX_LINKS 8
+
+// Offer the receiver to rebuild the file from the copy it already has
+// (START parameter 2): it answers with block signatures on the first link
+// and the file goes out as literal data for the changed regions and
+// references to the blocks it can copy
+#define DELTA_MODE 1
+
+// Signature packet: C, first block (4 bytes), block size (4 bytes), total
+// blocks (4 bytes), then a weak (4 bytes) and strong (8 bytes) hash per block
+#define SIGNATURE_HEADER_SIZE 13
+#define SIGNATURE_ENTRY_SIZE 12
+
+// Copy packet: C, file offset (4 bytes), first block (4 bytes), blocks (4 bytes)
+#define COPY_PACKET_SIZE 13
+
+// Offer to resume an interrupted transfer: START carries the version of the
+// source file (parameter 3, its modification time in ns). The receiver keeps
+// a checkpoint (<file>.ckpt) of the bytes on disk, at most every
+// CHECKPOINT_INTERVAL seconds and when the transfer fails, and answers a
+// START for the same version with a resume packet: C, offset (4 bytes)
+#define RESUME_MODE 1
+#define CHECKPOINT_INTERVAL 2
+#define RESUME_PACKET_SIZE 5
+
+// Compress the data blocks that the probe finds compressible
+#define COMPRESSION 1
+
+// Cut the data so no frame is longer on the wire than a full frame without
+// escapes: FLAG / ESC heavy data then goes in more frames rather than in
+// frames up to twice as long, which would take up to twice the time
+// payloadForLine() budgets for them
+#define FRAME_FIT 1
+
+// Blocks in flight between the stages of the transmit pipeline
+#define PIPELINE_DEPTH 8
+
+// Receiver output (write_behind.h): reserve the size announced in START,
+// and write around the page cache (O_DIRECT)
+#define PREALLOCATE 1
+#define DIRECT_IO 0
+
+// Batch session: given a directory or a comma separated list of files, the
+// transmitter sends a manifest packet (C, files (4 bytes), total bytes
+// (8 bytes)) and then each file with its own START / END, named by its base
+// name. The receiver then takes its filename as the directory to write
+// them to. Each file's data only starts after the answer to its START, so
+// data of consecutive files never mixes on bonded links
+#define MANIFEST_PACKET_SIZE 13
+#define MAX_BATCH_FILES 100000
+
+// End-to-end check of the file: START announces the hashes (parameter 4,
+// a mask of HASH_*) that END carries (parameters 5 and 6), computed over
+// the whole file in order on both ends. The receiver also checks that the
+// file has the size announced in START
+#define HASH_XXH64 1
+#define HASH_SHA256 2
+#define FILE_HASHES HASH_XXH64
+
+// File every link appends its statistics to when closed, as a JSON line
+// (frame and byte counts, retransmissions, RTT and llwrite() latency
+// histograms); "" prints them to the console instead
+#define STATS_FILE ""
+
+// File every link appends its trace to when closed (trace.h: the newest
+// events of every frame sent and received, decoded with
+// tools/trace_decode); "" keeps no trace
+#define TRACE_FILE ""
+
+typedef struct
+{
+    int algorithms; // HASH_* mask
+    Xxh64 xxh;
+    Sha256 sha;
+    uint64_t xxhDigest;
+    unsigned char shaDigest[SHA256_SIZE];
+} FileHash;
+
+typedef struct
+{
+    unsigned long blocks;
+    unsigned long compressedBlocks;
+    unsigned long long rawBytes;
+    unsigned long long sentBytes;
+    double cpuSeconds; // Spent probing and compressing
+} CompressStats;
+
+// A checkpoint waiting for its data to be on disk
+typedef struct
+{
+    bool active;
+    uint64_t mark;    // From writeBehindMark()
+    uint32_t durable; // Contiguous bytes once the mark is served
+    double time;      // When the last one was taken
+} PendingCheckpoint;
+
+static void put_u32(unsigned char *p, uint32_t value)
+{
+    uint32_t be_value = htonl(value);
+    memcpy(p, &be_value, 4);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    uint32_t be_value;
+    memcpy(&be_value, p, 4);
+    return ntohl(be_value);
+}
+
+static double cpu_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double wall_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill the data field of a data packet with len bytes of data, compressed
+// when the block looks compressible and actually shrinks.
+// Returns the field length; *compressed tells which form was used.
+static int pack_data(unsigned char *field, const unsigned char *data, int len, bool *compressed,
+                     CompressStats *stats)
+{
+    int fieldSize = -1;
+    if (COMPRESSION)
+    {
+        double start = cpu_time();
+        if (compressProbe(data, len))
+            fieldSize = compressBlock(data, len, field, len - 1);
+        stats->cpuSeconds += cpu_time() - start;
+    }
+
+    *compressed = fieldSize > 0;
+    if (!*compressed)
+    {
+        memcpy(field, data, len);
+        fieldSize = len;
+    }
+    stats->blocks++;
+    stats->compressedBlocks += *compressed;
+    stats->rawBytes += len;
+    stats->sentBytes += fieldSize;
+    return fieldSize;
+}
+
+// Data carried by the data field of a data packet, decompressed into
+// buffer (MAX_DATA_SIZE bytes) if needed. Returns its length or -1 if it
+// does not decompress.
+static int unpack_data(const unsigned char *field, int fieldSize, bool compressed,
+                       unsigned char *buffer, const unsigned char **data)
+{
+    if (!compressed)
+    {
+        *data = field;
+        return fieldSize;
+    }
+    *data = buffer;
+    return decompressBlock(field, fieldSize, buffer, MAX_DATA_SIZE);
+}
+
+static void fileHashInit(FileHash *hash, int algorithms)
+{
+    hash->algorithms = algorithms;
+    xxh64Init(&hash->xxh, 0);
+    sha256Init(&hash->sha);
+}
+
+static void fileHashUpdate(FileHash *hash, const unsigned char *data, uint32_t len)
+{
+    if (hash->algorithms & HASH_XXH64)
+        xxh64Update(&hash->xxh, data, len);
+    if (hash->algorithms & HASH_SHA256)
+        sha256Update(&hash->sha, data, len);
+}
+
+static void fileHashFinish(FileHash *hash)
+{
+    hash->xxhDigest = xxh64Digest(&hash->xxh);
+    sha256Final(&hash->sha, hash->shaDigest);
+}
+
+// START / END packet. With hash, START announces its algorithms and END
+// carries its (finished) digests.
+static int build_control_packet(unsigned char *packet, int controlField, const char *filename,
+                                uint32_t fileSize, bool delta, uint64_t version, const FileHash *hash)
 {
     int index = 0;
 
     packet[index++] = (unsigned char)controlField;
 
     packet[index++] = 0;
-    packet[index++] = 4; 
+    packet[index++] = 4;
     uint32_t be_size = htonl(fileSize);
     memcpy(&packet[index], &be_size, 4);
     index += 4;
@@ -34,9 +280,105 @@ static int build_control_packet(unsigned char *packet, int controlField, const c
     memcpy(&packet[index], filename, filenameLength);
     index += filenameLength;
 
+    if (delta)
+    {
+        packet[index++] = 2;
+        packet[index++] = 1;
+        packet[index++] = 1;
+    }
+
+    if (version)
+    {
+        packet[index++] = 3;
+        packet[index++] = 8;
+        put_u32(&packet[index], (uint32_t)(version >> 32));
+        put_u32(&packet[index + 4], (uint32_t)version);
+        index += 8;
+    }
+
+    if (hash && controlField == START_PACKET)
+    {
+        packet[index++] = 4;
+        packet[index++] = 1;
+        packet[index++] = (unsigned char)hash->algorithms;
+    }
+    if (hash && controlField == END_PACKET && (hash->algorithms & HASH_XXH64))
+    {
+        packet[index++] = 5;
+        packet[index++] = 8;
+        put_u32(&packet[index], (uint32_t)(hash->xxhDigest >> 32));
+        put_u32(&packet[index + 4], (uint32_t)hash->xxhDigest);
+        index += 8;
+    }
+    if (hash && controlField == END_PACKET && (hash->algorithms & HASH_SHA256))
+    {
+        packet[index++] = 6;
+        packet[index++] = SHA256_SIZE;
+        memcpy(&packet[index], hash->shaDigest, SHA256_SIZE);
+        index += SHA256_SIZE;
+    }
+
     return index;
 }
 
+// Value of parameter T of a START / END packet with length L, or NULL
+static const unsigned char *find_param(const unsigned char *packet, int packetSize, int type, int length)
+{
+    int index = 1;
+    while (index + 2 <= packetSize)
+    {
+        int T = packet[index];
+        int L = packet[index + 1];
+        if (index + 2 + L > packetSize)
+            break;
+        if (T == type && L == length)
+            return &packet[index + 2];
+        index += 2 + L;
+    }
+    return NULL;
+}
+
+// File size carried in a START / END packet (0 if missing)
+static uint32_t parse_file_size(const unsigned char *packet, int packetSize)
+{
+    const unsigned char *value = find_param(packet, packetSize, 0, 4);
+    return value ? get_u32(value) : 0;
+}
+
+// File name carried in a START packet, copied to name (at least
+// MAX_FILENAME_LEN + 1 bytes). Returns 0 on success or -1 if missing.
+static int parse_file_name(const unsigned char *packet, int packetSize, char *name)
+{
+    int index = 1;
+    while (index + 2 <= packetSize)
+    {
+        int L = packet[index + 1];
+        if (index + 2 + L > packetSize)
+            break;
+        if (packet[index] == 1)
+        {
+            memcpy(name, &packet[index + 2], L);
+            name[L] = '\0';
+            return 0;
+        }
+        index += 2 + L;
+    }
+    return -1;
+}
+
+// Largest payload that still goes out within half a timeout at this
+// baudrate (10 bits per byte on the line), so big frames are only
+// proposed on lines fast enough to carry them.
+static int payloadForLine(int baudRate, int timeout)
+{
+    long bytes = (long)baudRate / 10 * timeout / 2;
+    if (bytes < MAX_PAYLOAD_SIZE)
+        return MAX_PAYLOAD_SIZE;
+    if (bytes > LL_MAX_PAYLOAD_LIMIT)
+        return LL_MAX_PAYLOAD_LIMIT;
+    return (int)bytes;
+}
+
 static long getFileSize(FILE *file)
 {
     fseek(file, 0, SEEK_END);
@@ -45,153 +387,1277 @@ static long getFileSize(FILE *file)
     return size;
 }
 
-void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename)
+// Open a link on every port of the comma separated list, in order.
+// Returns the number of links opened, or -1 on error (none left open).
+static int openLinks(const char *serialPorts, LinkLayer linkLayer, ll_ctx **links)
 {
-    LinkLayer linkLayer;
-    strncpy(linkLayer.serialPort, serialPort, sizeof(linkLayer.serialPort)-1);
-    linkLayer.serialPort[sizeof(linkLayer.serialPort)-1] = '\0';
-    linkLayer.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
-    linkLayer.baudRate = baudRate;
-    linkLayer.nRetransmissions = nTries;
-    linkLayer.timeout = timeout;
+    int nLinks = 0;
+    const char *port = serialPorts;
+    while (*port)
+    {
+        size_t len = strcspn(port, ",");
+        if (nLinks == MAX_LINKS || len == 0 || len >= sizeof(linkLayer.serialPort))
+        {
+            fprintf(stderr, "Invalid serial port list '%s'\n", serialPorts);
+            break;
+        }
+        memcpy(linkLayer.serialPort, port, len);
+        linkLayer.serialPort[len] = '\0';
 
-    printf("\n--- Opening link ---\n");
-    if (llopen(linkLayer) == -1)
+        links[nLinks] = llopen_ctx(linkLayer);
+        if (!links[nLinks])
+            break;
+        nLinks++;
+
+        port += len;
+        if (*port == ',')
+            port++;
+        if (!*port)
+            return nLinks;
+    }
+
+    while (nLinks > 0)
+        llclose_ctx(links[--nLinks]);
+    return -1;
+}
+
+// Close every link. Returns 0 if all closed cleanly or -1 otherwise.
+static int closeLinks(ll_ctx **links, int nLinks)
+{
+    // Wait for the acknowledgements of all links together: closing them one
+    // by one would leave the others unserved while each one drains
+    while (nLinks > 1)
     {
-        fprintf(stderr, "Error: llopen failed\n");
-        return;
+        int unacked = 0;
+        for (int i = 0; i < nLinks; ++i)
+        {
+            int n = llunacked_ctx(links[i]);
+            if (n > 0)
+                unacked += n;
+        }
+        if (unacked == 0 || llwait_ctx(links, nLinks, -1) < 0)
+            break;
     }
 
-    if (linkLayer.role == LlTx)
+    int result = 0;
+    for (int i = 0; i < nLinks; ++i)
+    {
+        if (llclose_ctx(links[i]) == -1)
+            result = -1;
+    }
+    return result;
+}
+
+// Send a packet on the link with the most free window slots, waiting for
+// acknowledgements while every window is full.
+// Returns 0 on success or -1 if a link failed.
+static int sendStriped(ll_ctx **links, int nLinks, const unsigned char *packet, int packetSize)
+{
+    while (1)
     {
-        FILE *file = fopen(filename, "rb");
-        if (!file)
+        int best = -1;
+        int bestFree = 0;
+        for (int i = 0; i < nLinks; ++i)
         {
-            perror("Error opening file");
-            llclose();
-            return;
+            int freeSlots = llwindow_ctx(links[i]);
+            if (freeSlots < 0)
+                return -1;
+            if (freeSlots > bestFree)
+            {
+                best = i;
+                bestFree = freeSlots;
+            }
         }
+        if (best >= 0)
+            return llsend_ctx(links[best], packet, packetSize) < 0 ? -1 : 0;
+        if (llwait_ctx(links, nLinks, -1) < 0)
+            return -1;
+    }
+}
 
-        long rawSize = getFileSize(file);
-        if (rawSize < 0) {
-            perror("ftell");
-            fclose(file);
-            llclose();
-            return;
+// Whether a receiver could have described its copy with count blocks of
+// blockSize bytes: deltaBlockSize() picks a power of two in bounds, and
+// below DELTA_MAX_BLOCK one whose square covers the copy, so such a copy
+// has at most blockSize blocks. Larger copies are held to the size of the
+// file sent.
+static bool validSignatures(uint32_t count, uint32_t blockSize, uint32_t fileSize)
+{
+    if (count == 0)
+        return true;
+    if (blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK || (blockSize & (blockSize - 1)) != 0)
+        return false;
+    return count <= fileSize / blockSize + 1 || (blockSize < DELTA_MAX_BLOCK && count <= blockSize);
+}
+
+// Read the receiver's answer to the delta / resume offers in START for a
+// file of fileSize bytes: the offset to resume from (*resumeAt), or the
+// block signatures of its copy. Gives up after waitMs without a packet (a
+// receiver without support for either never answers). Returns the number
+// of blocks, 0 if there is nothing to match against, or -1 on error or for
+// signatures that do not fit the file.
+static int receiveStartReply(ll_ctx *link, int waitMs, uint32_t fileSize, uint32_t *resumeAt, DeltaSig **sigs,
+                             int *blockSize)
+{
+    unsigned char *packet = malloc(llmaxpayload_ctx(link));
+    if (!packet)
+        return -1;
+
+    int total = -1;
+    int got = 0;
+    *sigs = NULL;
+    while (total < 0 || got < total)
+    {
+        int ready = llwait_ctx(&link, 1, waitMs);
+        if (ready == 1)
+        {
+            printf("No answer to START, sending the whole file.\n");
+            total = 0;
+            break;
         }
-        if (rawSize > UINT32_MAX) {
-            fprintf(stderr, "File too large (>4GB).\n");
-            fclose(file);
-            llclose();
-            return;
+        int packetSize = ready < 0 ? -1 : lltryread_ctx(link, packet);
+        if (packetSize == -1)
+        {
+            total = -1;
+            break;
+        }
+        if (total < 0 && packetSize == RESUME_PACKET_SIZE && packet[0] == RESUME_PACKET)
+        {
+            *resumeAt = get_u32(&packet[1]);
+            total = 0;
+            break;
         }
-        uint32_t fileSize = (uint32_t)rawSize;
+        if (packetSize < SIGNATURE_HEADER_SIZE || packet[0] != SIGNATURE_PACKET)
+            continue;
 
-        if (strlen(filename) > MAX_FILENAME_LEN) {
-            fprintf(stderr, "Filename too long (max %d chars).\n", MAX_FILENAME_LEN);
-            fclose(file);
-            llclose();
-            return;
+        uint32_t first = get_u32(&packet[1]);
+        if (total < 0)
+        {
+            uint32_t size = get_u32(&packet[5]);
+            uint32_t count = get_u32(&packet[9]);
+            if (!validSignatures(count, size, fileSize))
+                break;
+            *blockSize = (int)size;
+            total = (int)count;
+            if (total > 0)
+                *sigs = malloc(total * sizeof(DeltaSig));
+            if (total > 0 && !*sigs)
+            {
+                total = -1;
+                break;
+            }
         }
 
-        unsigned char packet[1024];
+        int entries = (packetSize - SIGNATURE_HEADER_SIZE) / SIGNATURE_ENTRY_SIZE;
+        for (int i = 0; i < entries && first + i < (uint32_t)total; ++i)
+        {
+            const unsigned char *entry = &packet[SIGNATURE_HEADER_SIZE + i * SIGNATURE_ENTRY_SIZE];
+            (*sigs)[first + i].weak = get_u32(entry);
+            (*sigs)[first + i].strong = (uint64_t)get_u32(entry + 4) << 32 | get_u32(entry + 8);
+        }
+        got += entries;
+    }
 
-        printf("Sending START packet...\n");
-        int packetSize = build_control_packet(packet, START_PACKET, filename, fileSize);
-        if (llwrite(packet, packetSize) < 0) {
-            fprintf(stderr, "Error: Failed to send START packet\n");
-            fclose(file);
-            llclose();
-            return;
+    free(packet);
+    if (total <= 0)
+    {
+        free(*sigs);
+        *sigs = NULL;
+    }
+    return total;
+}
+
+typedef struct
+{
+    ll_ctx **links;
+    int nLinks;
+    unsigned char *packet; // OFFSET_HEADER_SIZE + dataSize bytes
+    int dataSize;
+    int blockSize;
+    uint32_t literalBytes;
+    uint32_t copiedBytes;
+    uint32_t copies;
+    CompressStats *stats;
+} DeltaSender;
+
+// Wire size of a frame without escapes of the payload the tightest of the
+// links asks for now
+static int frameBudget(ll_ctx **links, int nLinks)
+{
+    int frameSize = 0;
+    for (int i = 0; i < nLinks; ++i)
+    {
+        int size = llframesize_ctx(links[i], llpayload_ctx(links[i]));
+        if (i == 0 || size < frameSize)
+            frameSize = size;
+    }
+    return frameSize;
+}
+
+// Length of the next data packet's data out of len bytes of data, at most
+// dataSize. With FRAME_FIT it is cut to what fits in a frame of
+// frameBudget() bytes on the links, counting the packet header as fully
+// escaped.
+static uint32_t dataChunk(ll_ctx **links, int nLinks, int dataSize, const unsigned char *data,
+                          uint32_t len)
+{
+    uint32_t chunk = len < (uint32_t)dataSize ? len : (uint32_t)dataSize;
+    if (!FRAME_FIT)
+        return chunk;
+    int fit = llfit_ctx(links[0], data, chunk, frameBudget(links, nLinks) - 2 * OFFSET_HEADER_SIZE);
+    return fit > 0 ? (uint32_t)fit : chunk;
+}
+
+// Send a changed region as offset data packets
+static int sendLiteral(void *arg, uint32_t offset, const unsigned char *data, uint32_t len)
+{
+    DeltaSender *d = arg;
+    while (len > 0)
+    {
+        uint32_t chunk = dataChunk(d->links, d->nLinks, d->dataSize, data, len);
+        bool compressed;
+        int fieldSize = pack_data(&d->packet[OFFSET_HEADER_SIZE], data, chunk, &compressed, d->stats);
+        d->packet[0] = DATA_OFFSET_PACKET | (compressed ? COMPRESSED_FLAG : 0);
+        put_u32(&d->packet[1], offset);
+        d->packet[5] = (uint8_t)((fieldSize >> 8) & 0xFF);
+        d->packet[6] = (uint8_t)(fieldSize & 0xFF);
+        if (sendStriped(d->links, d->nLinks, d->packet, OFFSET_HEADER_SIZE + fieldSize) == -1)
+            return -1;
+        d->literalBytes += chunk;
+        offset += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Send a reference to count blocks the receiver already has
+static int sendCopy(void *arg, uint32_t offset, uint32_t block, uint32_t count)
+{
+    DeltaSender *d = arg;
+    unsigned char packet[COPY_PACKET_SIZE];
+    packet[0] = COPY_PACKET;
+    put_u32(&packet[1], offset);
+    put_u32(&packet[5], block);
+    put_u32(&packet[9], count);
+    if (sendStriped(d->links, d->nLinks, packet, COPY_PACKET_SIZE) == -1)
+        return -1;
+    d->copiedBytes += count * d->blockSize;
+    d->copies++;
+    return 0;
+}
+
+// Send the file (fileSize mapped bytes) as the difference to the
+// receiver's copy. Returns 0 on success or -1 on error.
+static int sendDelta(ll_ctx **links, int nLinks, const unsigned char *data, uint32_t fileSize,
+                     const DeltaSig *sigs, int nSigs, int blockSize, int dataSize, CompressStats *stats)
+{
+    DeltaSender d = {links, nLinks, malloc(OFFSET_HEADER_SIZE + dataSize), dataSize,
+                     blockSize, 0, 0, 0, stats};
+    if (!d.packet)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    int result = deltaScan(sigs, nSigs, blockSize, data, fileSize, sendLiteral, sendCopy, &d);
+    printf("Delta: %u bytes sent as literals, %u bytes copied in %u references (%.1f%% of the file sent)\n",
+           d.literalBytes, d.copiedBytes, d.copies,
+           fileSize ? 100.0 * d.literalBytes / fileSize : 0.0);
+
+    free(d.packet);
+    return result;
+}
+
+// Transmit pipeline: a reader thread cuts the mapped file into blocks and
+// asks the kernel to page them in, an encoder thread probes, compresses and
+// wraps them in data packets, and the calling thread writes them to the
+// links. Blocks go round through SPSC queues, so the line is not kept
+// waiting by the disk or the compressor and the stages overlap on several
+// cores. The link contexts stay on the calling thread.
+typedef struct
+{
+    const unsigned char *data; // Block of the mapped file
+    unsigned char *packet;     // OFFSET_HEADER_SIZE + dataSize bytes
+    int dataLen;
+    int packetSize;
+    uint32_t offset;
+} PipeBlock;
+
+typedef struct
+{
+    const unsigned char *map;
+    uint32_t start;
+    uint32_t fileSize;
+    int dataSize;
+    ll_ctx **links;         // Only their frame settings are read (dataChunk())
+    int nLinks;
+    CompressStats *stats;   // Only touched by the encoder until it is done
+    FileHash *hash;         // Only touched by the reader until it is done
+    SpscQueue freeBlocks;   // Writer -> reader
+    SpscQueue readBlocks;   // Reader -> encoder
+    SpscQueue packetBlocks; // Encoder -> writer
+} Pipeline;
+
+static void *reader_thread(void *arg)
+{
+    Pipeline *p = arg;
+    uint32_t offset = p->start;
+    PipeBlock *b;
+    // The hash covers the whole file, including a part already received
+    fileHashUpdate(p->hash, p->map, p->start);
+    while (offset < p->fileSize && (b = spscPop(&p->freeBlocks)))
+    {
+        b->dataLen = dataChunk(p->links, p->nLinks, p->dataSize, p->map + offset, p->fileSize - offset);
+        b->data = p->map + offset;
+        b->offset = offset;
+        // Start reading the pages now; the encoder gets to them PIPELINE_DEPTH
+        // blocks later
+        uintptr_t page = (uintptr_t)b->data & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+        madvise((void *)page, (uintptr_t)b->data + b->dataLen - page, MADV_WILLNEED);
+        fileHashUpdate(p->hash, b->data, b->dataLen);
+        offset += b->dataLen;
+        spscPush(&p->readBlocks, b);
+    }
+    spscClose(&p->readBlocks);
+    return NULL;
+}
+
+static void *encoder_thread(void *arg)
+{
+    Pipeline *p = arg;
+    PipeBlock *b;
+    while ((b = spscPop(&p->readBlocks)))
+    {
+        bool compressed;
+        int fieldSize = pack_data(&b->packet[OFFSET_HEADER_SIZE], b->data, b->dataLen, &compressed, p->stats);
+        b->packet[0] = DATA_OFFSET_PACKET | (compressed ? COMPRESSED_FLAG : 0);
+        put_u32(&b->packet[1], b->offset);
+        b->packet[5] = (uint8_t)((fieldSize >> 8) & 0xFF);
+        b->packet[6] = (uint8_t)(fieldSize & 0xFF);
+        b->packetSize = OFFSET_HEADER_SIZE + fieldSize;
+        spscPush(&p->packetBlocks, b);
+    }
+    spscClose(&p->packetBlocks);
+    return NULL;
+}
+
+// Send the file (fileSize mapped bytes) from offset start as data packets
+// through the pipeline, adding the whole file to hash.
+// Returns 0 on success or -1 on error.
+static int sendPipelined(ll_ctx **links, int nLinks, const unsigned char *map, uint32_t start,
+                         uint32_t fileSize, int dataSize, CompressStats *stats, FileHash *hash)
+{
+    Pipeline p = {.map = map, .start = start, .fileSize = fileSize, .dataSize = dataSize,
+                  .links = links, .nLinks = nLinks, .stats = stats, .hash = hash};
+    PipeBlock blocks[PIPELINE_DEPTH] = {{0}};
+    int result = 0;
+
+    if (spscInit(&p.freeBlocks, PIPELINE_DEPTH) < 0 ||
+        spscInit(&p.readBlocks, PIPELINE_DEPTH) < 0 ||
+        spscInit(&p.packetBlocks, PIPELINE_DEPTH) < 0)
+        result = -1;
+    for (int i = 0; i < PIPELINE_DEPTH && result == 0; ++i)
+    {
+        blocks[i].packet = malloc(OFFSET_HEADER_SIZE + dataSize);
+        if (!blocks[i].packet)
+            result = -1;
+        else
+            spscPush(&p.freeBlocks, &blocks[i]);
+    }
+
+    pthread_t reader, encoder;
+    if (result == 0 && pthread_create(&reader, NULL, reader_thread, &p) != 0)
+        result = -1;
+    else if (result == 0 && pthread_create(&encoder, NULL, encoder_thread, &p) != 0)
+    {
+        // Stop the reader and take what it already read
+        spscClose(&p.freeBlocks);
+        while (spscPop(&p.readBlocks))
+            ;
+        pthread_join(reader, NULL);
+        result = -1;
+    }
+    else if (result == 0)
+    {
+        PipeBlock *b;
+        bool stopped = false;
+        while ((b = spscPop(&p.packetBlocks)))
+        {
+            if (!stopped && sendStriped(links, nLinks, b->packet, b->packetSize) == -1)
+            {
+                // The reader stops once the free blocks run out; the blocks
+                // already past it are drained and dropped
+                spscClose(&p.freeBlocks);
+                stopped = true;
+                result = -1;
+            }
+            if (!stopped)
+                spscPush(&p.freeBlocks, b);
+        }
+        pthread_join(reader, NULL);
+        pthread_join(encoder, NULL);
+    }
+    else
+        fprintf(stderr, "Out of memory\n");
+
+    for (int i = 0; i < PIPELINE_DEPTH; ++i)
+        free(blocks[i].packet);
+    spscDestroy(&p.freeBlocks);
+    spscDestroy(&p.readBlocks);
+    spscDestroy(&p.packetBlocks);
+    return result;
+}
+
+// Map the whole file read-only for a front to back pass, so packets are
+// built straight from the page cache. Returns the mapping (a dummy one for
+// an empty file) or NULL on error, with the file size in *size and its
+// modification time in ns in *version.
+static const unsigned char *mapFile(const char *filename, uint32_t *size, uint64_t *version)
+{
+    static const unsigned char empty[1];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Error opening file");
+        return NULL;
+    }
+
+    struct stat st;
+    const unsigned char *map = NULL;
+    if (fstat(fd, &st) < 0)
+        perror("fstat");
+    else if (st.st_size > UINT32_MAX)
+        fprintf(stderr, "File too large (>4GB).\n");
+    else if (st.st_size == 0)
+        map = empty;
+    else
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap");
+            map = NULL;
+        }
+        else
+            madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+    }
+    *size = map ? (uint32_t)st.st_size : 0;
+    *version = map ? (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec : 0;
+    close(fd);
+    return map;
+}
+
+static void unmapFile(const unsigned char *map, uint32_t size)
+{
+    if (size > 0)
+        munmap((void *)map, size);
+}
+
+// Send the file at filename, announced in START as name.
+// Returns 0 on success or -1 on error.
+static int sendFile(ll_ctx **links, int nLinks, const char *filename, const char *name, int waitMs)
+{
+    if (strlen(name) > MAX_FILENAME_LEN) {
+        fprintf(stderr, "Filename too long (max %d chars).\n", MAX_FILENAME_LEN);
+        return -1;
+    }
+
+    uint32_t fileSize;
+    uint64_t version;
+    const unsigned char *map = mapFile(filename, &fileSize, &version);
+    if (!map)
+        return -1;
+
+    unsigned char packet[1024];
+    FileHash hash;
+    fileHashInit(&hash, FILE_HASHES);
+
+    // Control packets always go on the first link
+    printf("Sending START packet...\n");
+    int packetSize = build_control_packet(packet, START_PACKET, name, fileSize, DELTA_MODE,
+                                          RESUME_MODE ? version : 0, &hash);
+    if (llsend_ctx(links[0], packet, packetSize) < 0) {
+        fprintf(stderr, "Error: Failed to send START packet\n");
+        unmapFile(map, fileSize);
+        return -1;
+    }
+
+    DeltaSig *sigs = NULL;
+    int nSigs = 0;
+    int blockSize = 0;
+    uint32_t resumeAt = 0;
+    if (DELTA_MODE || RESUME_MODE)
+    {
+        nSigs = receiveStartReply(links[0], waitMs, fileSize, &resumeAt, &sigs, &blockSize);
+        if (nSigs < 0 || resumeAt > fileSize)
+        {
+            fprintf(stderr, "Error: Invalid answer to START\n");
+            free(sigs);
+            unmapFile(map, fileSize);
+            return -1;
         }
+        if (resumeAt > 0)
+            printf("Resuming from byte %u of %u.\n", resumeAt, fileSize);
+        else if (DELTA_MODE)
+            printf("Receiver has %d blocks of %d bytes.\n", nSigs, blockSize);
+    }
 
-        unsigned char dataBuffer[512];
-        int seq = 0;
-        size_t bytesRead;
-        bool error = false;
+    // Fill every frame up to the payload agreed in llopen()
+    int dataSize = MAX_DATA_SIZE;
+    for (int i = 0; i < nLinks; ++i)
+    {
+        if (llmaxpayload_ctx(links[i]) - OFFSET_HEADER_SIZE < dataSize)
+            dataSize = llmaxpayload_ctx(links[i]) - OFFSET_HEADER_SIZE;
+    }
+    bool error = false;
+    CompressStats stats = {0};
 
-        while ((bytesRead = fread(dataBuffer, 1, sizeof(dataBuffer), file)) > 0)
+    if (nSigs > 0)
+    {
+        fileHashUpdate(&hash, map, fileSize);
+        if (sendDelta(links, nLinks, map, fileSize, sigs, nSigs, blockSize, dataSize, &stats) == -1)
         {
-            unsigned char dataPacket[4 + sizeof(dataBuffer)];
-            int index = 0;
-            dataPacket[index++] = DATA_PACKET;
-            dataPacket[index++] = (uint8_t)(seq % 256);
-            dataPacket[index++] = (uint8_t)((bytesRead >> 8) & 0xFF);
-            dataPacket[index++] = (uint8_t)(bytesRead & 0xFF);
+            fprintf(stderr, "Error: Failed to send delta\n");
+            error = true;
+        }
+    }
+    else if (sendPipelined(links, nLinks, map, resumeAt, fileSize, dataSize, &stats, &hash) == -1)
+    {
+        fprintf(stderr, "Error: Failed to send data packet\n");
+        error = true;
+    }
+
+    printf("Sending END packet...\n");
+    fileHashFinish(&hash);
+    packetSize = build_control_packet(packet, END_PACKET, name, fileSize, false, 0, &hash);
+    if (llsend_ctx(links[0], packet, packetSize) < 0)
+        error = true;
+
+    if (stats.blocks > 0)
+    {
+        printf("Compression: %lu of %lu blocks compressed, %llu -> %llu bytes (%.1f%% saved) for %.2f ms of CPU\n",
+               stats.compressedBlocks, stats.blocks, stats.rawBytes, stats.sentBytes,
+               100.0 * (stats.rawBytes - stats.sentBytes) / stats.rawBytes, stats.cpuSeconds * 1e3);
+    }
+
+    free(sigs);
+    unmapFile(map, fileSize);
+    if (!error){
+        printf("File '%s' sent successfully (%u bytes)\n\n", filename, fileSize);
+    } else {
+        fprintf(stderr, "File transmission failed! File sent was incomplete.\n\n");
+    }
+    return error ? -1 : 0;
+}
 
-            memcpy(&dataPacket[index], dataBuffer, bytesRead);
-            index += bytesRead;
+// Answer a delta offer with the signatures of every full block of base
+// (none if there is no base) and store the block size in *blockSize.
+// Returns 0 on success or -1 on error.
+static int sendSignatures(ll_ctx *link, FILE *base, int *blockSize)
+{
+    uint32_t total = 0;
+    *blockSize = 0;
+    if (base)
+    {
+        long baseSize = getFileSize(base);
+        *blockSize = deltaBlockSize(baseSize > 0 ? baseSize : 0);
+        total = baseSize > 0 ? baseSize / *blockSize : 0;
+    }
+
+    int packetCap = llmaxpayload_ctx(link);
+    int perPacket = (packetCap - SIGNATURE_HEADER_SIZE) / SIGNATURE_ENTRY_SIZE;
+    unsigned char *packet = malloc(packetCap);
+    unsigned char *block = malloc(*blockSize > 0 ? *blockSize : 1);
+    int result = (packet && block) ? 0 : -1;
 
-            if (llwrite(dataPacket, index) == -1)
+    uint32_t first = 0;
+    while (result == 0)
+    {
+        int index = SIGNATURE_HEADER_SIZE;
+        uint32_t n = 0;
+        while (n < (uint32_t)perPacket && first + n < total)
+        {
+            if (fread(block, 1, *blockSize, base) != (size_t)*blockSize)
             {
-                fprintf(stderr, "Error: Failed to send data packet\n");
-                error = true;
+                result = -1;
                 break;
             }
-            seq++;
+            put_u32(&packet[index], deltaWeak(block, *blockSize));
+            uint64_t strong = deltaStrong(block, *blockSize);
+            put_u32(&packet[index + 4], (uint32_t)(strong >> 32));
+            put_u32(&packet[index + 8], (uint32_t)strong);
+            index += SIGNATURE_ENTRY_SIZE;
+            n++;
         }
+        if (result == -1)
+            break;
+
+        packet[0] = SIGNATURE_PACKET;
+        put_u32(&packet[1], first);
+        put_u32(&packet[5], *blockSize);
+        put_u32(&packet[9], total);
+        if (llsend_ctx(link, packet, index) < 0)
+            result = -1;
+        first += n;
+        if (first >= total)
+            break;
+    }
+
+    if (result == 0)
+        printf("Sent the signatures of %u blocks of %d bytes.\n", total, *blockSize);
+    free(packet);
+    free(block);
+    return result;
+}
+
+// Copy count blocks of base starting at block to offset of file, through
+// buffer (one block). Returns the bytes copied or -1 on error.
+static long copyBlocks(FILE *base, WriteBehind *file, int blockSize, unsigned char *buffer,
+                       uint32_t offset, uint32_t block, uint32_t count)
+{
+    if (fseek(base, (long)block * blockSize, SEEK_SET) != 0)
+        return -1;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (fread(buffer, 1, blockSize, base) != (size_t)blockSize ||
+            writeBehindWrite(file, offset + (uint64_t)i * blockSize, buffer, blockSize) == -1)
+            return -1;
+    }
+    return (long)count * blockSize;
+}
+
+// Make what was received durable and record in the checkpoint how much of
+// it is contiguous from the start, waiting for the disk: only once the
+// transfer is over. Returns 0 on success or -1 on error.
+static int saveCheckpoint(WriteBehind *file, const char *ckptName, Checkpoint *ckpt,
+                          const RangeTracker *written)
+{
+    uint64_t unsynced;
+    if (writeBehindSync(file, &unsynced) == -1)
+        return -1;
+    ckpt->durable = written->prefix < unsynced ? written->prefix : (uint32_t)unsynced;
+    return checkpointSave(ckptName, ckpt, 1);
+}
 
-        printf("Sending END packet...\n");
-        packetSize = build_control_packet(packet, END_PACKET, filename, fileSize);
-        llwrite(packet, packetSize);
+// Every CHECKPOINT_INTERVAL, ask the flush thread to make what was received
+// durable, and record the contiguous part of it in the checkpoint once the
+// flush thread reports it on disk, so the loop that acknowledges frames
+// never waits on the disk. The checkpoint itself is not synced either: a
+// crash may lose it, which only makes the resume start earlier.
+static void updateCheckpoint(WriteBehind *file, const char *ckptName, Checkpoint *ckpt,
+                             const RangeTracker *written, PendingCheckpoint *pending)
+{
+    if (pending->active)
+    {
+        int durable = writeBehindDurable(file, pending->mark);
+        if (durable == 0)
+            return;
+        pending->active = false;
+        ckpt->durable = pending->durable;
+        if (durable == -1 || checkpointSave(ckptName, ckpt, 0) == -1)
+            fprintf(stderr, "Error: Failed to save checkpoint '%s'\n", ckptName);
+    }
+    if (wall_time() - pending->time >= CHECKPOINT_INTERVAL)
+    {
+        uint64_t unsynced;
+        pending->mark = writeBehindMark(file, &unsynced);
+        pending->durable = written->prefix < unsynced ? written->prefix : (uint32_t)unsynced;
+        pending->active = true;
+        pending->time = wall_time();
+    }
+}
 
-        fclose(file);
-        if (!error){
-            printf("File '%s' sent successfully (%u bytes)\n\n", filename, fileSize);
-        } else {
-            fprintf(stderr, "File transmission failed! File sent was incomplete.\n\n");
+// Check the received file at path against the size announced in START and
+// the digests END carried (expected), finishing hash, which already covers
+// the first hashed bytes that came in order, with the rest read back from
+// the file through buffer. Returns 0 if it matches or -1 otherwise.
+static int verifyFile(const char *path, uint32_t size, FileHash *hash, uint32_t hashed,
+                      const FileHash *expected, unsigned char *buffer, int bufferSize)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("Error checking file");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size != size)
+    {
+        fprintf(stderr, "Error: File has %lld bytes, START announced %u\n", (long long)st.st_size, size);
+        close(fd);
+        return -1;
+    }
+
+    uint32_t readBack = 0;
+    while (hash->algorithms && hashed < size)
+    {
+        ssize_t n = pread(fd, buffer, bufferSize, hashed);
+        if (n <= 0)
+        {
+            perror("Error reading file");
+            close(fd);
+            return -1;
         }
-    }    
-    else
+        fileHashUpdate(hash, buffer, n);
+        hashed += n;
+        readBack += n;
+    }
+    close(fd);
+    fileHashFinish(hash);
+
+    if ((expected->algorithms & hash->algorithms) != hash->algorithms)
+    {
+        fprintf(stderr, "Error: END is missing the file hash\n");
+        return -1;
+    }
+    if (((hash->algorithms & HASH_XXH64) && hash->xxhDigest != expected->xxhDigest) ||
+        ((hash->algorithms & HASH_SHA256) && memcmp(hash->shaDigest, expected->shaDigest, SHA256_SIZE) != 0))
+    {
+        fprintf(stderr, "Error: File hash does not match the source\n");
+        return -1;
+    }
+    if (hash->algorithms)
+        printf("File hash verified (%u bytes hashed as received, %u read back).\n", size - readBack, readBack);
+    return 0;
+}
+
+// Wait for the next packet on any link and read it into packet.
+// Returns its size or -1 if a link failed or the transmitter went silent.
+static int nextPacket(ll_ctx **links, int nLinks, int waitMs, unsigned char *packet)
+{
+    while (1)
     {
-        FILE *file = fopen(filename, "wb");
-        if (!file)
+        // The transmitter gives up on a frame after nRetransmissions
+        // timeouts: after that long without a frame it is gone
+        int link = llwait_ctx(links, nLinks, waitMs);
+        if (link < 0)
+            return -1;
+        if (link == nLinks)
         {
-            perror("Error creating file");
-            llclose();
-            return;
+            fprintf(stderr, "Error: No frames for %d s\n", waitMs / 1000);
+            return -1;
         }
 
-        unsigned char packet[1024];
-        int packetSize;
-        int receiving = 1;
+        int packetSize = lltryread_ctx(links[link], packet);
+        if (packetSize == -1)
+            fprintf(stderr, "Error: Link %d failed\n", link);
+        if (packetSize != 0)
+            return packetSize;
+    }
+}
+
+// Receive one file into filename. packet (packetCap bytes) may already hold
+// its first packet (*held bytes); a START of the next file that turns up
+// while the last data of this one is still coming in is left there.
+// Returns 1 if the file was received, 0 if it failed or -1 if the links did.
+static int receiveFile(ll_ctx **links, int nLinks, const char *filename, int waitMs,
+                       unsigned char *packet, int *held)
+{
+    unsigned char *decompressed = malloc(MAX_DATA_SIZE);
+    char *tempName = malloc(strlen(filename) + sizeof(".delta"));
+    char *ckptName = malloc(strlen(filename) + sizeof(".ckpt"));
+    if (!decompressed || !tempName || !ckptName)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(decompressed);
+        free(tempName);
+        free(ckptName);
+        return -1;
+    }
+    sprintf(tempName, "%s.delta", filename);
+    sprintf(ckptName, "%s.ckpt", filename);
+
+    // The file is only created once START tells whether the transfer is a
+    // delta: then it is rebuilt next to the existing copy (base), which it
+    // replaces after END
+    WriteBehind *file = NULL;
+    FILE *base = NULL;
+    bool useTemp = false;
+    uint32_t startSize = 0;
+    uint32_t appendOffset = 0;
+    unsigned char *blockBuffer = NULL;
+    int blockSize = 0;
+
+    // Progress of a transfer that can be resumed
+    bool resumable = false;
+    Checkpoint ckpt = {0};
+    RangeTracker written;
+    rangesInit(&written, 0);
+    PendingCheckpoint pending = {false, 0, 0, wall_time()};
 
-        while (receiving)
+    // The hash is fed with the data that comes in file order; whatever
+    // does not is read back from the file at the end
+    FileHash hash;
+    fileHashInit(&hash, 0);
+    uint32_t hashed = 0;
+    FileHash expected = {0};
+
+    // With bonded links the END packet may overtake data still in flight on
+    // the other links: the transfer ends once every byte is in as well
+    uint32_t fileSize = 0;
+    uint32_t received = 0;
+    bool started = false;
+    bool gotEnd = false;
+    bool error = false;
+    bool linkLost = false;
+
+    while (!gotEnd || received < fileSize)
+    {
+        int packetSize = *held;
+        *held = 0;
+        if (packetSize == 0 && (packetSize = nextPacket(links, nLinks, waitMs, packet)) == -1)
         {
-            packetSize = llread(packet);
+            linkLost = true;
+            break;
+        }
 
-            if (packetSize == -1)
+        unsigned char control = packet[0] & ~COMPRESSED_FLAG;
+        bool compressed = packet[0] & COMPRESSED_FLAG;
+
+        if (control == START_PACKET && gotEnd)
+        {
+            // The next file of a batch; it waits for the rest of this one
+            *held = packetSize;
+            continue;
+        }
+        if (control == START_PACKET)
+        {
+            printf("START packet received.\n");
+            if (started)
                 continue;
+            started = true;
+            startSize = parse_file_size(packet, packetSize);
+            const unsigned char *hashes = find_param(packet, packetSize, 4, 1);
+            fileHashInit(&hash, hashes ? *hashes & (HASH_XXH64 | HASH_SHA256) : 0);
+            const unsigned char *delta = find_param(packet, packetSize, 2, 1);
+            const unsigned char *version = find_param(packet, packetSize, 3, 8);
+
+            if (version)
+            {
+                resumable = true;
+                uint64_t sourceVersion = (uint64_t)get_u32(version) << 32 | get_u32(version + 4);
+                if (checkpointLoad(ckptName, &ckpt) == 0 && ckpt.durable > 0 &&
+                    ckpt.fileSize == startSize && ckpt.source == sourceVersion)
+                {
+                    useTemp = ckpt.temp;
+                    file = writeBehindOpen(useTemp ? tempName : filename, 0, DIRECT_IO, 1);
+                    if (!file)
+                    {
+                        perror("Error opening file");
+                        error = true;
+                        break;
+                    }
+                    unsigned char resume[RESUME_PACKET_SIZE] = {RESUME_PACKET};
+                    put_u32(&resume[1], ckpt.durable);
+                    if (llsend_ctx(links[0], resume, RESUME_PACKET_SIZE) < 0)
+                    {
+                        linkLost = true;
+                        break;
+                    }
+                    printf("Resuming from byte %u of %u.\n", ckpt.durable, startSize);
+                    received = appendOffset = ckpt.durable;
+                    rangesInit(&written, ckpt.durable);
+                    continue;
+                }
+                ckpt = (Checkpoint){startSize, sourceVersion, 0, 0};
+            }
 
-            if (packetSize == 0)
+            if (!delta || *delta != 1)
                 continue;
+            base = fopen(filename, "rb");
+            if (sendSignatures(links[0], base, &blockSize) == -1)
+            {
+                fprintf(stderr, "Error: Failed to send block signatures\n");
+                error = true;
+                break;
+            }
+            if (base)
+            {
+                useTemp = true;
+                ckpt.temp = 1;
+                blockBuffer = malloc(blockSize);
+                file = writeBehindOpen(tempName, PREALLOCATE ? startSize : 0, DIRECT_IO, 0);
+                if (!blockBuffer || !file)
+                {
+                    perror("Error creating file");
+                    error = true;
+                    break;
+                }
+            }
+            continue;
+        }
 
-            unsigned char control = packet[0];
+        if (!file && control != END_PACKET &&
+            !(file = writeBehindOpen(filename, PREALLOCATE ? startSize : 0, DIRECT_IO, 0)))
+        {
+            perror("Error creating file");
+            error = true;
+            break;
+        }
 
-            if (control == START_PACKET)
+        if (control == DATA_PACKET || control == DATA_OFFSET_PACKET)
+        {
+            int headerSize = control == DATA_PACKET ? DATA_HEADER_SIZE : OFFSET_HEADER_SIZE;
+            int fieldSize = packetSize < headerSize ? -1 : packet[headerSize - 2] * 256 + packet[headerSize - 1];
+            if (fieldSize == -1 || headerSize + fieldSize > packetSize)
             {
-                printf("START packet received.\n");
+                fprintf(stderr, "Error: Data packet shorter than its header says\n");
+                error = true;
+                break;
             }
-            else if (control == DATA_PACKET)
+            const unsigned char *data;
+            int dataSize = unpack_data(&packet[headerSize], fieldSize, compressed, decompressed, &data);
+            if (dataSize == -1)
             {
-                int dataSize = packet[2] * 256 + packet[3];
-                fwrite(&packet[4], 1, dataSize, file);
+                fprintf(stderr, "Error: Corrupt compressed data packet\n");
+                error = true;
+                break;
             }
-            else if (control == END_PACKET)
+            uint32_t offset = control == DATA_OFFSET_PACKET ? get_u32(&packet[1]) : appendOffset;
+            if (writeBehindWrite(file, offset, data, dataSize) == -1)
             {
-                printf("END packet received.\n");
-                receiving = 0;
+                error = true;
+                break;
             }
+            rangesAdd(&written, offset, dataSize);
+            if (offset == hashed)
+            {
+                fileHashUpdate(&hash, data, dataSize);
+                hashed += dataSize;
+            }
+            appendOffset = offset + dataSize;
+            received += dataSize;
         }
+        else if (control == COPY_PACKET && packetSize == COPY_PACKET_SIZE)
+        {
+            uint32_t offset = get_u32(&packet[1]);
+            long copied = base ? copyBlocks(base, file, blockSize, blockBuffer, offset,
+                                            get_u32(&packet[5]), get_u32(&packet[9]))
+                               : -1;
+            if (copied == -1)
+            {
+                fprintf(stderr, "Error: Failed to copy blocks from '%s'\n", filename);
+                error = true;
+                break;
+            }
+            rangesAdd(&written, offset, copied);
+            received += copied;
+        }
+        else if (control == END_PACKET)
+        {
+            printf("END packet received.\n");
+            fileSize = parse_file_size(packet, packetSize);
+            gotEnd = true;
+            const unsigned char *xxh = find_param(packet, packetSize, 5, 8);
+            const unsigned char *sha = find_param(packet, packetSize, 6, SHA256_SIZE);
+            if (xxh)
+            {
+                expected.algorithms |= HASH_XXH64;
+                expected.xxhDigest = (uint64_t)get_u32(xxh) << 32 | get_u32(xxh + 4);
+            }
+            if (sha)
+            {
+                expected.algorithms |= HASH_SHA256;
+                memcpy(expected.shaDigest, sha, SHA256_SIZE);
+            }
+        }
+
+        if (resumable && file)
+            updateCheckpoint(file, ckptName, &ckpt, &written, &pending);
+    }
+
+    bool complete = gotEnd && received >= fileSize && !error;
+
+    // An empty file has no data packets to create it
+    if (!file && complete)
+        file = writeBehindOpen(filename, 0, 0, 0);
+
+    if (!complete && resumable && file && !error)
+    {
+        if (saveCheckpoint(file, ckptName, &ckpt, &written) == 0)
+            printf("Checkpoint saved: a new transfer resumes from byte %u.\n", ckpt.durable);
+        else
+            fprintf(stderr, "Error: Failed to save checkpoint '%s'\n", ckptName);
+    }
+
+    if (base)
+        fclose(base);
+    WriteBehindStats diskStats;
+    if (file)
+    {
+        if (writeBehindClose(file, &diskStats) == -1)
+            complete = false;
+        printf("Wrote %llu bytes in %lu writes%s\n", (unsigned long long)diskStats.bytes, diskStats.writes,
+               diskStats.direct ? " (O_DIRECT)" : "");
+    }
+    if (complete && (fileSize != startSize ||
+                     verifyFile(useTemp ? tempName : filename, startSize, &hash, hashed, &expected,
+                                decompressed, MAX_DATA_SIZE) == -1))
+    {
+        // What is on disk is wrong: it must not be resumed either
+        if (fileSize != startSize)
+            fprintf(stderr, "Error: END announced %u bytes, START %u\n", fileSize, startSize);
+        unlink(ckptName);
+        complete = false;
+    }
+    if (complete && useTemp && rename(tempName, filename) != 0)
+    {
+        perror("Error replacing file");
+        complete = false;
+    }
+    if (complete)
+        unlink(ckptName);
 
-        fclose(file);
+    free(decompressed);
+    free(tempName);
+    free(ckptName);
+    free(blockBuffer);
+    if (complete)
         printf("File '%s' received successfully.\n\n", filename);
+    else
+        fprintf(stderr, "File reception failed! File '%s' is incomplete.\n\n", filename);
+    return complete ? 1 : linkLost ? -1 : 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Collect the regular files of the batch: those in directory files, or
+// listed in files separated by commas. Returns how many were stored in
+// *paths (each and the array allocated) or -1 on error.
+static int listBatch(const char *files, char ***paths, unsigned long long *totalSize)
+{
+    int count = 0;
+    int cap = 16;
+    char **list = malloc(cap * sizeof(char *));
+    DIR *dir = opendir(files);
+    const char *next = files;
+    *totalSize = 0;
+
+    while (list)
+    {
+        char *path;
+        if (dir)
+        {
+            struct dirent *entry = readdir(dir);
+            if (!entry)
+                break;
+            path = malloc(strlen(files) + strlen(entry->d_name) + 2);
+            if (path)
+                sprintf(path, "%s/%s", files, entry->d_name);
+        }
+        else
+        {
+            if (!*next)
+                break;
+            size_t len = strcspn(next, ",");
+            path = strndup(next, len);
+            next += len + (next[len] == ',');
+        }
+
+        struct stat st;
+        if (!path || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            if (path && !dir)
+                fprintf(stderr, "Skipping '%s': not a regular file\n", path);
+            free(path);
+            continue;
+        }
+        if (count == MAX_BATCH_FILES)
+        {
+            fprintf(stderr, "Too many files (max %d).\n", MAX_BATCH_FILES);
+            free(path);
+            break;
+        }
+        if (count == cap)
+        {
+            char **grown = realloc(list, 2 * cap * sizeof(char *));
+            if (!grown)
+            {
+                free(path);
+                break;
+            }
+            list = grown;
+            cap *= 2;
+        }
+        list[count++] = path;
+        *totalSize += st.st_size;
+    }
+    if (dir)
+        closedir(dir);
+    if (!list)
+        return -1;
+    if (dir)
+        qsort(list, count, sizeof(char *), compare_names);
+    *paths = list;
+    return count;
+}
+
+// Send a single file, or every file of a batch after a manifest.
+static void sendSession(ll_ctx **links, int nLinks, const char *files, int waitMs)
+{
+    struct stat st;
+    if (!strchr(files, ',') && !(stat(files, &st) == 0 && S_ISDIR(st.st_mode)))
+    {
+        sendFile(links, nLinks, files, files, waitMs);
+        return;
+    }
+
+    char **paths;
+    unsigned long long totalSize;
+    int count = listBatch(files, &paths, &totalSize);
+    if (count < 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    printf("Sending manifest: %d files, %llu bytes.\n\n", count, totalSize);
+    unsigned char manifest[MANIFEST_PACKET_SIZE] = {MANIFEST_PACKET};
+    put_u32(&manifest[1], count);
+    put_u32(&manifest[5], (uint32_t)(totalSize >> 32));
+    put_u32(&manifest[9], (uint32_t)totalSize);
+    int sent = 0;
+    double start = wall_time();
+    if (llsend_ctx(links[0], manifest, MANIFEST_PACKET_SIZE) < 0)
+        fprintf(stderr, "Error: Failed to send manifest\n");
+    else
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            const char *name = strrchr(paths[i], '/');
+            if (sendFile(links, nLinks, paths[i], name ? name + 1 : paths[i], waitMs) == 0)
+                sent++;
+            else if (llwindow_ctx(links[0]) < 0)
+                break;
+        }
+    }
+    double elapsed = wall_time() - start;
+    printf("Batch: %d of %d files sent in %.2f s (%.1f files/s)\n\n", sent, count, elapsed,
+           elapsed > 0 ? sent / elapsed : 0.0);
+
+    for (int i = 0; i < count; ++i)
+        free(paths[i]);
+    free(paths);
+}
+
+// Receive a single file into output, or a batch into the directory output
+// if the transmitter starts with a manifest.
+static void receiveSession(ll_ctx **links, int nLinks, const char *output, int waitMs)
+{
+    int packetCap = 0;
+    for (int i = 0; i < nLinks; ++i)
+    {
+        if (llmaxpayload_ctx(links[i]) > packetCap)
+            packetCap = llmaxpayload_ctx(links[i]);
+    }
+    unsigned char *packet = malloc(packetCap);
+    if (!packet)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+
+    int held = nextPacket(links, nLinks, waitMs, packet);
+    if (held == -1)
+    {
+        fprintf(stderr, "File reception failed! File '%s' is incomplete.\n\n", output);
+        free(packet);
+        return;
+    }
+    if (held != MANIFEST_PACKET_SIZE || packet[0] != MANIFEST_PACKET)
+    {
+        receiveFile(links, nLinks, output, waitMs, packet, &held);
+        free(packet);
+        return;
+    }
+
+    uint32_t count = get_u32(&packet[1]);
+    unsigned long long totalSize = (unsigned long long)get_u32(&packet[5]) << 32 | get_u32(&packet[9]);
+    printf("Manifest received: %u files, %llu bytes into '%s'.\n\n", count, totalSize, output);
+    held = 0;
+    if (mkdir(output, 0755) != 0 && errno != EEXIST)
+    {
+        perror("Error creating directory");
+        count = 0;
     }
 
+    char *path = malloc(strlen(output) + MAX_FILENAME_LEN + 16);
+    uint32_t received = 0;
+    uint32_t done = 0;
+    while (path && done < count)
+    {
+        if (held == 0 && (held = nextPacket(links, nLinks, waitMs, packet)) == -1)
+            break;
+        if (packet[0] != START_PACKET)
+        {
+            held = 0;
+            continue;
+        }
+
+        // Only the base name is used, and never one that leaves output
+        char name[MAX_FILENAME_LEN + 1];
+        char *base = name;
+        if (parse_file_name(packet, held, name) == 0 && strrchr(name, '/'))
+            base = strrchr(name, '/') + 1;
+        if (parse_file_name(packet, held, name) != 0 || !*base || strcmp(base, ".") == 0 ||
+            strcmp(base, "..") == 0)
+            sprintf(path, "%s/file%u", output, done);
+        else
+            sprintf(path, "%s/%s", output, base);
+
+        int result = receiveFile(links, nLinks, path, waitMs, packet, &held);
+        done++;
+        if (result == 1)
+            received++;
+        if (result == -1)
+            break;
+    }
+    printf("Batch: %u of %u files received.\n\n", received, count);
+    free(path);
+    free(packet);
+}
+
+void applicationLayer(const char *serialPort, const char *role, int baudRate,
+                      int nTries, int timeout, const char *filename)
+{
+    LinkLayer linkLayer;
+    linkLayer.role = (strcmp(role, "tx") == 0) ? LlTx : LlRx;
+    linkLayer.baudRate = baudRate;
+    linkLayer.nRetransmissions = nTries;
+    linkLayer.timeout = timeout;
+    linkLayer.windowSize = WINDOW_SIZE;
+    linkLayer.fcs = FCS_MODE;
+    linkLayer.scramble = SCRAMBLE;
+    linkLayer.fec = FEC_PARITY;
+    linkLayer.adaptive = HYBRID_ARQ;
+    linkLayer.maxPayloadSize = payloadForLine(baudRate, timeout);
+    snprintf(linkLayer.statsFile, sizeof(linkLayer.statsFile), "%s", STATS_FILE);
+    snprintf(linkLayer.traceFile, sizeof(linkLayer.traceFile), "%s", TRACE_FILE);
+
+    printf("\n--- Opening link ---\n");
+    ll_ctx *links[MAX_LINKS];
+    int nLinks = openLinks(serialPort, linkLayer, links);
+    if (nLinks == -1)
+    {
+        fprintf(stderr, "Error: llopen failed\n");
+        return;
+    }
+    if (nLinks > 1)
+        printf("Bonding %d links.\n\n", nLinks);
+
+    if (linkLayer.role == LlTx)
+        sendSession(links, nLinks, filename, (nTries + 1) * timeout * 1000);
+    else
+        receiveSession(links, nLinks, filename, (nTries + 1) * timeout * 1000);
+
     printf("--- Closing link ---\n");
-    if (llclose() == -1)
+    if (closeLinks(links, nLinks) == -1)
         fprintf(stderr, "Error: llclose failed\n");
     else
         printf("Link closed successfully.\n");
-}
\ No newline at end of file
+}
@@ -0,0 +1,108 @@
+// Receiver checkpoint.
+// The file holds a magic, then the file size, source version (8 bytes),
+// durable length and temporary flag, big-endian like the packets.
+
+#include "checkpoint.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CKPT_MAGIC "RCK1"
+#define CKPT_SIZE 21
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    uint32_t be_value = htonl(value);
+    memcpy(p, &be_value, 4);
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t be_value;
+    memcpy(&be_value, p, 4);
+    return ntohl(be_value);
+}
+
+int checkpointLoad(const char *path, Checkpoint *ckpt) {
+    unsigned char buf[CKPT_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, CKPT_SIZE);
+    close(fd);
+    if (n != CKPT_SIZE || memcmp(buf, CKPT_MAGIC, 4) != 0) return -1;
+
+    ckpt->fileSize = get_u32(&buf[4]);
+    ckpt->source = (uint64_t)get_u32(&buf[8]) << 32 | get_u32(&buf[12]);
+    ckpt->durable = get_u32(&buf[16]);
+    ckpt->temp = buf[20];
+    return ckpt->durable <= ckpt->fileSize ? 0 : -1;
+}
+
+int checkpointSave(const char *path, const Checkpoint *ckpt, int sync) {
+    unsigned char buf[CKPT_SIZE];
+    memcpy(buf, CKPT_MAGIC, 4);
+    put_u32(&buf[4], ckpt->fileSize);
+    put_u32(&buf[8], (uint32_t)(ckpt->source >> 32));
+    put_u32(&buf[12], (uint32_t)ckpt->source);
+    put_u32(&buf[16], ckpt->durable);
+    buf[20] = (unsigned char)ckpt->temp;
+
+    char *temp = malloc(strlen(path) + sizeof(".tmp"));
+    if (!temp) return -1;
+    sprintf(temp, "%s.tmp", path);
+
+    int result = -1;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write(fd, buf, CKPT_SIZE) == CKPT_SIZE && (!sync || fsync(fd) == 0)) result = 0;
+        close(fd);
+        if (result == 0 && rename(temp, path) != 0) result = -1;
+        if (result != 0) unlink(temp);
+    }
+    free(temp);
+    return result;
+}
+
+void rangesInit(RangeTracker *r, uint32_t prefix) {
+    r->prefix = prefix;
+    r->count = 0;
+}
+
+void rangesAdd(RangeTracker *r, uint32_t offset, uint32_t len) {
+    uint32_t end = offset + len;
+    if (end <= r->prefix) return;
+
+    if (offset <= r->prefix) {
+        r->prefix = end;
+    } else {
+        // Merge with the ranges it touches, keeping them sorted
+        int i = 0;
+        while (i < r->count && r->end[i] < offset) i++;
+        int j = i;
+        while (j < r->count && r->start[j] <= end) {
+            if (r->start[j] < offset) offset = r->start[j];
+            if (r->end[j] > end) end = r->end[j];
+            j++;
+        }
+        if (i == j && r->count == RANGES_MAX) return;
+        memmove(&r->start[i + 1], &r->start[j], (r->count - j) * sizeof(uint32_t));
+        memmove(&r->end[i + 1], &r->end[j], (r->count - j) * sizeof(uint32_t));
+        r->count += 1 - (j - i);
+        r->start[i] = offset;
+        r->end[i] = end;
+    }
+
+    // Ranges the prefix now reaches join it
+    int k = 0;
+    while (k < r->count && r->start[k] <= r->prefix) {
+        if (r->end[k] > r->prefix) r->prefix = r->end[k];
+        k++;
+    }
+    if (k > 0) {
+        memmove(&r->start[0], &r->start[k], (r->count - k) * sizeof(uint32_t));
+        memmove(&r->end[0], &r->end[k], (r->count - k) * sizeof(uint32_t));
+        r->count -= k;
+    }
+}
@@ -0,0 +1,48 @@
+// Receiver checkpoint header.
+// A checkpoint file next to a partly received file records how much of it
+// is on disk, so a restarted transfer of the same source file can resume
+// from there instead of from byte 0.
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+    uint32_t fileSize; // Size announced in START
+    uint64_t source;   // Version of the source file announced in START
+    uint32_t durable;  // Bytes from the start of the file known to be on disk
+    int temp;          // Data goes to the delta temporary, not the file itself
+} Checkpoint;
+
+// Read the checkpoint at path.
+// Returns 0 on success or -1 if it is missing or invalid.
+int checkpointLoad(const char *path, Checkpoint *ckpt);
+
+// Replace the checkpoint at path atomically (written aside and renamed
+// over it). With sync, it is on disk before it replaces the old one;
+// without, a crash may leave the old one or none, never a wrong one.
+// Returns 0 on success or -1 on error.
+int checkpointSave(const char *path, const Checkpoint *ckpt, int sync);
+
+// Ranges written out of order beyond the prefix that are remembered; any
+// more are forgotten, which only makes the checkpoint more pessimistic
+#define RANGES_MAX 64
+
+// Tracks the length of the part written contiguously from the start of
+// the file when writes come in any order (bonded links).
+typedef struct
+{
+    uint32_t prefix;
+    int count;
+    uint32_t start[RANGES_MAX];
+    uint32_t end[RANGES_MAX];
+} RangeTracker;
+
+void rangesInit(RangeTracker *r, uint32_t prefix);
+
+// Record len bytes written at offset.
+void rangesAdd(RangeTracker *r, uint32_t offset, uint32_t len);
+
+#endif // _CHECKPOINT_H_
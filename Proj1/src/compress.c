@@ -0,0 +1,141 @@
+// Block compression.
+// The codec is a greedy LZ77 in the LZ4 block format: a sequence is a token
+// (literal run length in the high nibble, match length - 4 in the low one,
+// 15 meaning more length bytes follow), the literals, a 2-byte little-endian
+// offset and the extra match length bytes. The last sequence only has
+// literals. Matches are found through a hash table of 4-byte prefixes; the
+// search step grows on long runs without a match so random data passes
+// through quickly.
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 13
+#define LAST_LITERALS 5  // Bytes at the end that are always literals
+#define SKIP_SHIFT 5     // Misses before the search step grows by one
+
+#define PROBE_SAMPLES 4096
+#define PROBE_MIN_LEN 64
+// The probe accepts a block whose sampled byte frequencies give a
+// collision probability above 1 / PROBE_RANDOMNESS (1 / 256 for random data)
+#define PROBE_RANDOMNESS 160
+
+int compressProbe(const unsigned char *in, int len) {
+    if (len < PROBE_MIN_LEN) return 0;
+
+    uint32_t count[256] = {0};
+    int step = len / PROBE_SAMPLES + 1;
+    uint64_t n = 0;
+    for (int i = 0; i < len; i += step, ++n) count[in[i]]++;
+
+    // Pairs of equal samples, without each sample paired with itself
+    uint64_t pairs = 0;
+    for (int i = 0; i < 256; ++i) pairs += (uint64_t)count[i] * count[i];
+    pairs -= n;
+    return pairs * PROBE_RANDOMNESS > n * (n - 1);
+}
+
+static uint32_t hash4(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length that did not fit in its nibble as 255-valued bytes
+static int put_length(unsigned char *out, int o, int len) {
+    for (; len >= 255; len -= 255) out[o++] = 255;
+    out[o++] = (unsigned char)len;
+    return o;
+}
+
+// Append a sequence (matchLen 0 for the last one). Returns the new output
+// length or -1 if it does not fit in outcap.
+static int put_sequence(unsigned char *out, int o, int outcap, const unsigned char *lit, int litLen,
+                        int offset, int matchLen) {
+    int ml = matchLen ? matchLen - MIN_MATCH : 0;
+    int size = 1 + litLen + (litLen >= 15 ? (litLen - 15) / 255 + 1 : 0);
+    if (matchLen) size += 2 + (ml >= 15 ? (ml - 15) / 255 + 1 : 0);
+    if (o + size > outcap) return -1;
+
+    unsigned char *token = &out[o++];
+    *token = (unsigned char)(((litLen < 15 ? litLen : 15) << 4) | (ml < 15 ? ml : 15));
+    if (litLen >= 15) o = put_length(out, o, litLen - 15);
+    memcpy(out + o, lit, litLen);
+    o += litLen;
+    if (matchLen) {
+        out[o++] = (unsigned char)(offset & 0xFF);
+        out[o++] = (unsigned char)(offset >> 8);
+        if (ml >= 15) o = put_length(out, o, ml - 15);
+    }
+    return o;
+}
+
+int compressBlock(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
+    int table[1 << HASH_BITS]; // Last position + 1 of each hash, 0 if none
+    memset(table, 0, sizeof(table));
+
+    int anchor = 0, i = 0, o = 0, misses = 0;
+    int limit = inlen - LAST_LITERALS;
+    while (i < limit) {
+        uint32_t h = hash4(in + i);
+        int ref = table[h] - 1;
+        table[h] = i + 1;
+        if (ref < 0 || i - ref > MAX_OFFSET || memcmp(in + ref, in + i, MIN_MATCH) != 0) {
+            i += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+
+        int len = MIN_MATCH;
+        while (i + len < limit && in[ref + len] == in[i + len]) len++;
+        o = put_sequence(out, o, outcap, in + anchor, i - anchor, i - ref, len);
+        if (o < 0) return -1;
+        i += len;
+        anchor = i;
+    }
+    return put_sequence(out, o, outcap, in + anchor, inlen - anchor, 0, 0);
+}
+
+// Read the extra bytes of a length whose nibble was 15
+static int get_length(const unsigned char *in, int *ip, int inlen, int *len) {
+    unsigned char b;
+    do {
+        if (*ip >= inlen) return -1;
+        b = in[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int decompressBlock(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
+    int ip = 0, op = 0;
+    while (ip < inlen) {
+        unsigned char token = in[ip++];
+
+        int litLen = token >> 4;
+        if (litLen == 15 && get_length(in, &ip, inlen, &litLen) < 0) return -1;
+        if (litLen > inlen - ip || litLen > outcap - op) return -1;
+        memcpy(out + op, in + ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == inlen) break;
+
+        if (ip + 2 > inlen) return -1;
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int matchLen = token & 0x0F;
+        if (matchLen == 15 && get_length(in, &ip, inlen, &matchLen) < 0) return -1;
+        matchLen += MIN_MATCH;
+        if (offset == 0 || offset > op || matchLen > outcap - op) return -1;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        const unsigned char *src = out + op - offset;
+        for (int k = 0; k < matchLen; ++k) out[op + k] = src[k];
+        op += matchLen;
+    }
+    return op;
+}
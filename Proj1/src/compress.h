@@ -0,0 +1,23 @@
+// Block compression header.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Guess from a sample of the byte frequencies whether len bytes are worth
+// handing to compressBlock(). Already compressed data (images, archives)
+// looks random and is rejected for a fraction of the cost of trying.
+// Returns 1 if the block should be compressed, 0 otherwise.
+int compressProbe(const unsigned char *in, int len);
+
+// Compress inlen bytes (at most 65535) from in into out with a greedy
+// LZ77 codec in the LZ4 block format (literal runs and 2-byte offsets).
+// Returns the compressed length or -1 if it does not fit in outcap; pass
+// outcap < inlen to only accept output that saves space.
+int compressBlock(const unsigned char *in, int inlen, unsigned char *out, int outcap);
+
+// Undo compressBlock().
+// Returns the decompressed length or -1 on malformed input or if it does
+// not fit in outcap.
+int decompressBlock(const unsigned char *in, int inlen, unsigned char *out, int outcap);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,112 @@
+// CRC implementation.
+// The slice-by-8 loops fold 8 input bytes per step through 8 lookup tables
+// built once at program start.
+
+#include "crc.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+#define CRC16_POLY 0x8408      // 0x1021 reflected
+#define CRC32_POLY 0xEDB88320  // 0x04C11DB7 reflected
+#define CRC32C_POLY 0x82F63B78 // 0x1EDC6F41 reflected
+
+static uint16_t crc16Table[256];
+static uint32_t crc32Table[8][256];
+static uint32_t crc32cTable[8][256];
+static int useHardware = 0;
+
+static void build_slice8(uint32_t table[8][256], uint32_t poly) {
+    for (int i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+        table[0][i] = c;
+    }
+    for (int i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t)
+            table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+    }
+}
+
+__attribute__((constructor))
+static void crc_init() {
+    for (int i = 0; i < 256; ++i) {
+        uint16_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ CRC16_POLY : c >> 1;
+        crc16Table[i] = c;
+    }
+    build_slice8(crc32Table, CRC32_POLY);
+    build_slice8(crc32cTable, CRC32C_POLY);
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    useHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t slice8(const uint32_t table[8][256], uint32_t crc, const unsigned char *p, int len) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint32_t a, b;
+        memcpy(&a, p, 4);
+        memcpy(&b, p + 4, 4);
+        a ^= crc;
+        crc = table[7][a & 0xFF] ^ table[6][(a >> 8) & 0xFF] ^
+              table[5][(a >> 16) & 0xFF] ^ table[4][a >> 24] ^
+              table[3][b & 0xFF] ^ table[2][(b >> 8) & 0xFF] ^
+              table[1][(b >> 16) & 0xFF] ^ table[0][b >> 24];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len-- > 0) crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+uint16_t crc16(const unsigned char *buf, int len) {
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len; ++i) crc = crc16Table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFF;
+}
+
+uint32_t crc32(const unsigned char *buf, int len) {
+    return slice8(crc32Table, 0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+}
+
+uint32_t crc32cSlice8(const unsigned char *buf, int len) {
+    return slice8(crc32cTable, 0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const unsigned char *p, int len) {
+    uint32_t crc = 0xFFFFFFFF;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+    return crc ^ 0xFFFFFFFF;
+}
+#endif
+
+uint32_t crc32c(const unsigned char *buf, int len) {
+#ifdef HAVE_SSE42_CRC
+    if (useHardware) return crc32c_sse42(buf, len);
+#endif
+    return crc32cSlice8(buf, len);
+}
+
+int crc32cHardware() {
+    return useHardware;
+}
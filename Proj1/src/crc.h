@@ -0,0 +1,25 @@
+// CRC header.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stdint.h>
+
+// CRC-16/X.25, the HDLC FCS-16 (reflected 0x1021, init and xorout 0xFFFF).
+// Table driven, one byte per step.
+uint16_t crc16(const unsigned char *buf, int len);
+
+// CRC-32 (IEEE 802.3, reflected 0x04C11DB7). Slice-by-8 tables.
+uint32_t crc32(const unsigned char *buf, int len);
+
+// CRC-32C (Castagnoli, reflected 0x1EDC6F41). Uses the SSE4.2 crc32
+// instruction when the CPU has it, otherwise crc32cSlice8().
+uint32_t crc32c(const unsigned char *buf, int len);
+
+// CRC-32C in software with slice-by-8 tables.
+uint32_t crc32cSlice8(const unsigned char *buf, int len);
+
+// Returns 1 if crc32c() runs on the SSE4.2 instruction, 0 otherwise.
+int crc32cHardware();
+
+#endif // _CRC_H_
@@ -0,0 +1,179 @@
+// Delta transfer: block signatures and the rolling match.
+// The weak checksum can be rolled one byte along the new file in constant
+// time, so every offset is tried against the hash table of the receiver's
+// blocks; the strong hash (CRC-32 and CRC-32C side by side) is only
+// computed when the weak sums collide.
+
+#include "delta.h"
+#include "crc.h"
+
+#include <stdlib.h>
+
+int deltaBlockSize(uint64_t fileSize) {
+    int size = DELTA_MIN_BLOCK;
+    while (size < DELTA_MAX_BLOCK && (uint64_t)size * size < fileSize)
+        size *= 2;
+    return size;
+}
+
+uint32_t deltaWeak(const unsigned char *buf, int len) {
+    uint32_t a = 0, b = 0;
+    for (int i = 0; i < len; ++i) {
+        a += buf[i];
+        b += a;
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+uint64_t deltaStrong(const unsigned char *buf, int len) {
+    return ((uint64_t)crc32(buf, len) << 32) | crc32c(buf, len);
+}
+
+////////////////////////////////////////////////
+// Matching
+////////////////////////////////////////////////
+typedef struct {
+    const DeltaSig *sigs;
+    int count;
+    int *head; // First block of each hash bucket, -1 if empty
+    int *next; // Next block in the same bucket
+    uint32_t mask;
+} SigIndex;
+
+static uint32_t bucket(const SigIndex *idx, uint32_t weak) {
+    return (weak * 2654435761u) >> 8 & idx->mask;
+}
+
+static int index_build(SigIndex *idx, const DeltaSig *sigs, int count) {
+    uint32_t buckets = 1;
+    while (buckets < 2 * (uint32_t)count)
+        buckets *= 2;
+
+    idx->sigs = sigs;
+    idx->count = count;
+    idx->mask = buckets - 1;
+    idx->head = malloc(buckets * sizeof(int));
+    idx->next = malloc((count > 0 ? count : 1) * sizeof(int));
+    if (!idx->head || !idx->next) {
+        free(idx->head);
+        free(idx->next);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < buckets; ++i)
+        idx->head[i] = -1;
+    // Inserted backwards so each bucket lists its blocks in file order
+    for (int i = count - 1; i >= 0; --i) {
+        uint32_t h = bucket(idx, sigs[i].weak);
+        idx->next[i] = idx->head[h];
+        idx->head[h] = i;
+    }
+    return 0;
+}
+
+// Block whose signature matches the len bytes at data, or -1.
+// The block after the previous match is tried first, so unchanged runs
+// coalesce into a single copy.
+static int index_find(const SigIndex *idx, uint32_t weak, const unsigned char *data, int len, int preferred) {
+    uint64_t strong = 0;
+    int haveStrong = 0;
+
+    if (preferred >= 0 && preferred < idx->count && idx->sigs[preferred].weak == weak) {
+        strong = deltaStrong(data, len);
+        haveStrong = 1;
+        if (idx->sigs[preferred].strong == strong)
+            return preferred;
+    }
+
+    for (int i = idx->head[bucket(idx, weak)]; i >= 0; i = idx->next[i]) {
+        if (idx->sigs[i].weak != weak)
+            continue;
+        if (!haveStrong) {
+            strong = deltaStrong(data, len);
+            haveStrong = 1;
+        }
+        if (idx->sigs[i].strong == strong)
+            return i;
+    }
+    return -1;
+}
+
+int deltaScan(const DeltaSig *sigs, int count, int blockSize,
+              const unsigned char *data, uint32_t size,
+              DeltaLiteralFn literal, DeltaCopyFn copy, void *arg) {
+    SigIndex idx;
+    if (index_build(&idx, sigs, count) < 0)
+        return -1;
+
+    uint32_t pos = 0;      // Start of the window being matched
+    uint32_t lit = 0;      // Start of the literal run not yet emitted
+    uint32_t copyAt = 0;   // Pending copy: destination, first block, blocks
+    uint32_t copyBlock = 0;
+    uint32_t copyCount = 0;
+    int result = 0;
+
+    uint32_t a = 0, b = 0;
+    if (count > 0 && size >= (uint32_t)blockSize) {
+        uint32_t weak = deltaWeak(data, blockSize);
+        a = weak & 0xFFFF;
+        b = weak >> 16;
+    }
+
+    while (count > 0 && pos + blockSize <= size) {
+        int preferred = copyCount > 0 && copyAt + copyCount * blockSize == pos
+                            ? (int)(copyBlock + copyCount) : -1;
+        int block = index_find(&idx, (a & 0xFFFF) | (b << 16), data + pos, blockSize, preferred);
+
+        if (block >= 0) {
+            if (lit < pos) {
+                if (copyCount > 0 && copy(arg, copyAt, copyBlock, copyCount) < 0) {
+                    result = -1;
+                    break;
+                }
+                copyCount = 0;
+                if (literal(arg, lit, data + lit, pos - lit) < 0) {
+                    result = -1;
+                    break;
+                }
+            }
+            if (copyCount > 0 && block == preferred) {
+                copyCount++;
+            } else {
+                if (copyCount > 0 && copy(arg, copyAt, copyBlock, copyCount) < 0) {
+                    result = -1;
+                    break;
+                }
+                copyAt = pos;
+                copyBlock = block;
+                copyCount = 1;
+            }
+
+            pos += blockSize;
+            lit = pos;
+            if (pos + blockSize <= size) {
+                uint32_t weak = deltaWeak(data + pos, blockSize);
+                a = weak & 0xFFFF;
+                b = weak >> 16;
+            }
+            continue;
+        }
+
+        // Slide the window one byte: drop data[pos], take data[pos + blockSize]
+        if (pos + blockSize < size) {
+            uint32_t out = data[pos];
+            uint32_t in = data[pos + blockSize];
+            a = (a - out + in) & 0xFFFF;
+            b = (b - (uint32_t)blockSize * out + a) & 0xFFFF;
+        }
+        pos++;
+    }
+
+    if (result == 0 && copyCount > 0 && copy(arg, copyAt, copyBlock, copyCount) < 0)
+        result = -1;
+    if (result == 0 && lit < size && literal(arg, lit, data + lit, size - lit) < 0)
+        result = -1;
+
+    free(idx.head);
+    free(idx.next);
+    return result;
+}
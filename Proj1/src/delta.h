@@ -0,0 +1,44 @@
+// Delta transfer header.
+// The receiver describes the copy it already has with one signature per
+// block (a rolling weak checksum and a strong hash); the transmitter then
+// finds those blocks anywhere in the new file and only sends the rest.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+
+// Bounds for the block size picked by deltaBlockSize()
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 32768
+
+typedef struct
+{
+    uint32_t weak;   // deltaWeak() of the block
+    uint64_t strong; // deltaStrong() of the block
+} DeltaSig;
+
+// Block size for a file of fileSize bytes: about its square root, which
+// balances the signature size against the literal bytes around each change.
+int deltaBlockSize(uint64_t fileSize);
+
+// Rolling checksum of len bytes (rsync weak sum): sum of the bytes in the
+// low 16 bits, sum of the running sums in the high 16 bits.
+uint32_t deltaWeak(const unsigned char *buf, int len);
+
+// Strong hash of len bytes, checked once the weak sums match.
+uint64_t deltaStrong(const unsigned char *buf, int len);
+
+// Receive the parts of the new file, in file order.
+// Each returns 0 to go on or -1 to stop the scan.
+typedef int (*DeltaLiteralFn)(void *arg, uint32_t offset, const unsigned char *data, uint32_t len);
+typedef int (*DeltaCopyFn)(void *arg, uint32_t offset, uint32_t block, uint32_t count);
+
+// Find the blocks described by sigs in data and describe data as literal
+// runs and copies of count consecutive blocks starting at block.
+// Returns 0 on success, -1 if a callback stopped the scan or out of memory.
+int deltaScan(const DeltaSig *sigs, int count, int blockSize,
+              const unsigned char *data, uint32_t size,
+              DeltaLiteralFn literal, DeltaCopyFn copy, void *arg);
+
+#endif // _DELTA_H_
@@ -0,0 +1,212 @@
+// File hash implementation.
+// XXH64 follows the reference xxHash spec: four lanes over 32-byte
+// stripes, merged and avalanched at the end. SHA-256 is the plain
+// 64-round compression over 64-byte blocks.
+
+#include "hash.h"
+
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i) v = v << 8 | p[i];
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void xxh_stripe(uint64_t v[4], const unsigned char *p) {
+    v[0] = xxh_round(v[0], read64(p));
+    v[1] = xxh_round(v[1], read64(p + 8));
+    v[2] = xxh_round(v[2], read64(p + 16));
+    v[3] = xxh_round(v[3], read64(p + 24));
+}
+
+void xxh64Init(Xxh64 *h, uint64_t seed) {
+    h->v[0] = seed + PRIME64_1 + PRIME64_2;
+    h->v[1] = seed + PRIME64_2;
+    h->v[2] = seed;
+    h->v[3] = seed - PRIME64_1;
+    h->total = 0;
+    h->bufLen = 0;
+}
+
+void xxh64Update(Xxh64 *h, const unsigned char *data, uint64_t len) {
+    h->total += len;
+    if (h->bufLen > 0) {
+        int n = 32 - h->bufLen;
+        if ((uint64_t)n > len) n = len;
+        memcpy(h->buf + h->bufLen, data, n);
+        h->bufLen += n;
+        data += n;
+        len -= n;
+        if (h->bufLen < 32) return;
+        xxh_stripe(h->v, h->buf);
+        h->bufLen = 0;
+    }
+    while (len >= 32) {
+        xxh_stripe(h->v, data);
+        data += 32;
+        len -= 32;
+    }
+    memcpy(h->buf, data, len);
+    h->bufLen = len;
+}
+
+uint64_t xxh64Digest(const Xxh64 *h) {
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; ++i) acc = xxh_merge(acc, h->v[i]);
+    } else {
+        acc = h->v[2] + PRIME64_5;
+    }
+    acc += h->total;
+
+    const unsigned char *p = h->buf;
+    int len = h->bufLen;
+    while (len >= 8) {
+        acc ^= xxh_round(0, read64(p));
+        acc = rotl64(acc, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        acc ^= read32(p) * PRIME64_1;
+        acc = rotl64(acc, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    while (len-- > 0) {
+        acc ^= *p++ * PRIME64_5;
+        acc = rotl64(acc, 11) * PRIME64_1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= PRIME64_2;
+    acc ^= acc >> 29;
+    acc *= PRIME64_3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t state[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256Init(Sha256 *h) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(h->state, initial, sizeof(initial));
+    h->total = 0;
+    h->bufLen = 0;
+}
+
+void sha256Update(Sha256 *h, const unsigned char *data, uint64_t len) {
+    h->total += len;
+    if (h->bufLen > 0) {
+        int n = 64 - h->bufLen;
+        if ((uint64_t)n > len) n = len;
+        memcpy(h->buf + h->bufLen, data, n);
+        h->bufLen += n;
+        data += n;
+        len -= n;
+        if (h->bufLen < 64) return;
+        sha256_block(h->state, h->buf);
+        h->bufLen = 0;
+    }
+    while (len >= 64) {
+        sha256_block(h->state, data);
+        data += 64;
+        len -= 64;
+    }
+    memcpy(h->buf, data, len);
+    h->bufLen = len;
+}
+
+void sha256Final(Sha256 *h, unsigned char digest[SHA256_SIZE]) {
+    uint64_t bits = h->total * 8;
+    h->buf[h->bufLen++] = 0x80;
+    if (h->bufLen > 56) {
+        memset(h->buf + h->bufLen, 0, 64 - h->bufLen);
+        sha256_block(h->state, h->buf);
+        h->bufLen = 0;
+    }
+    memset(h->buf + h->bufLen, 0, 56 - h->bufLen);
+    for (int i = 0; i < 8; ++i) h->buf[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_block(h->state, h->buf);
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = (unsigned char)(h->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(h->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(h->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)h->state[i];
+    }
+}
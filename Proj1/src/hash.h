@@ -0,0 +1,38 @@
+// File hash header.
+// Streaming hashes of a whole file, fed in file order as the data goes by,
+// so the transmitter and the receiver can compare the file end to end.
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stdint.h>
+
+// XXH64: fast, not cryptographic
+typedef struct
+{
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32]; // Input not yet making up a full stripe
+    int bufLen;
+} Xxh64;
+
+void xxh64Init(Xxh64 *h, uint64_t seed);
+void xxh64Update(Xxh64 *h, const unsigned char *data, uint64_t len);
+uint64_t xxh64Digest(const Xxh64 *h);
+
+// SHA-256 (FIPS 180-4): slower, cryptographic
+#define SHA256_SIZE 32
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t total;
+    unsigned char buf[64];
+    int bufLen;
+} Sha256;
+
+void sha256Init(Sha256 *h);
+void sha256Update(Sha256 *h, const unsigned char *data, uint64_t len);
+void sha256Final(Sha256 *h, unsigned char digest[SHA256_SIZE]);
+
+#endif // _HASH_H_
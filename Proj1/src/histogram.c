@@ -0,0 +1,56 @@
+// Histogram implementation.
+// Bucket i < 2 * HIST_SUB_BUCKETS holds the value i. Above that, a value
+// with its highest bit at position b is shifted right by b - 5 into
+// [HIST_SUB_BUCKETS, 2 * HIST_SUB_BUCKETS), and that shift picks the group
+// of HIST_SUB_BUCKETS buckets and the shifted value the bucket within it.
+
+#include "histogram.h"
+
+#define SUB_BITS 5 // log2(HIST_SUB_BUCKETS)
+
+static int bucket_of(uint64_t v) {
+    if (v < 2 * HIST_SUB_BUCKETS) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    if (shift > HIST_MAX_SHIFT) return HIST_BUCKETS - 1;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)(v >> shift) - HIST_SUB_BUCKETS;
+}
+
+// Largest value that falls in bucket i
+static uint64_t bucket_top(int i) {
+    if (i < 2 * HIST_SUB_BUCKETS) return i;
+    int shift = i / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histRecord(Histogram *h, uint64_t value) {
+    if (h->count == 0 || value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[bucket_of(value)]++;
+}
+
+uint64_t histQuantile(const Histogram *h, double q) {
+    if (h->count == 0) return 0;
+    if (q < 0) q = 0;
+    if (q > 1) q = 1;
+    // Rank of the value wanted, counting from 1
+    uint64_t rank = (uint64_t)(q * h->count);
+    if (rank < q * h->count || rank < 1) rank++;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            if (top > h->max) top = h->max;
+            if (top < h->min) top = h->min;
+            return top;
+        }
+    }
+    return h->max;
+}
+
+double histMean(const Histogram *h) {
+    return h->count ? (double)h->sum / h->count : 0.0;
+}
@@ -0,0 +1,36 @@
+// Histogram header.
+// Log-linear histograms in the style of HdrHistogram: values below
+// 2 * HIST_SUB_BUCKETS are counted exactly, larger ones in HIST_SUB_BUCKETS
+// buckets per power of two, so a quantile is off by at most 1/32 (3%) of
+// its value. Recording is a few shifts and an increment, and a zeroed
+// histogram is empty.
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+#define HIST_SUB_BUCKETS 32
+#define HIST_MAX_SHIFT 34 // Values up to 2^40 (12 days in microseconds); larger ones count as the largest
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} Histogram;
+
+// Count one value.
+void histRecord(Histogram *h, uint64_t value);
+
+// Value at quantile q (0 to 1): the top of the bucket that holds it, but no
+// more than the largest value recorded. Returns 0 if the histogram is empty.
+uint64_t histQuantile(const Histogram *h, double q);
+
+// Mean of the values recorded, or 0 if there are none.
+double histMean(const Histogram *h);
+
+#endif // _HISTOGRAM_H_
@@ -2,18 +2,27 @@
 
 #include "link_layer.h"
 #include "serial_port.h"
+#include "stuffing.h"
+#include "crc.h"
+#include "rs.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
 
 #define _POSIX_SOURCE 1
 
-// Basic frame constants
-#define FLAG 0x7E
+// Basic frame constants (FLAG / ESC come from stuffing.h)
 #define A_TX 0x03
 #define A_RX 0x01
 
@@ -21,40 +30,299 @@
 #define C_UA  0x07
 #define C_DISC 0x0B
 
-// I-frame control (Ns bit in bit 7)
-#define C_I_NS0 0x00
-#define C_I_NS1 0x80
+// I / RR / REJ frame types. The sequence number (Ns for I-frames, Nr for
+// RR / REJ) lives in the control bits above seq_shift.
+#define C_I   0x00
+#define C_RR  0x05
+#define C_REJ 0x01
 
-// RR / REJ control values
-#define C_RR0  0x05
-#define C_RR1  0x85
-#define C_REJ0 0x01
-#define C_REJ1 0x81
+// Stop-and-wait keeps the single Ns / Nr bit in bit 7 (C_I = 0x00 / 0x80,
+// RR = 0x05 / 0x85, REJ = 0x01 / 0x81). The windowed mode uses the whole
+// high nibble, i.e. sequence numbers modulo 16.
+#define SEQ_SHIFT_SW  7
+#define SEQ_SHIFT_WIN 4
 
-#define ESC 0x7D
-#define ESC_XOR 0x20
+// Link parameters carried as T L V in the information field of SET / UA
+#define PARAM_WINDOW 0x00
+#define PARAM_FCS    0x01
+#define PARAM_MAX_PAYLOAD 0x02
+#define PARAM_SCRAMBLE 0x03
+#define PARAM_FEC 0x04
+#define PARAM_HARQ 0x05
+#define MAX_PARAMS_SIZE 32
 
-#ifndef MAX_PAYLOAD_SIZE
-#define MAX_PAYLOAD_SIZE 1024
-#endif
-#define MAX_FRAME_SIZE (2*MAX_PAYLOAD_SIZE + 64)
+// read_frame() without blocking: no complete frame yet
+#define READ_AGAIN (-2)
 
-#define FLUSH_LIMIT 10000
+// Retransmission timeout bounds. The configured timeout is the initial RTO
+// and its upper bound; MIN_RTO_US keeps USB adapters and scheduler jitter
+// from causing spurious retransmissions. A timeout shorter than the
+// configured one resends without using up the frame's retransmissions, so
+// a receiver that stalls for a moment cannot fail the link: only the
+// configured timeout, which the backoff soon reaches, does that.
+// CLOCK_G_US is the timer granularity.
+#define MIN_RTO_US 50000
+#define CLOCK_G_US 1000
 
-// Globals
-volatile int STOP = 0;
-static volatile sig_atomic_t alarm_fired = 0;
+// Hybrid ARQ: the byte error rate is estimated over the last HARQ_HISTORY
+// frames sent, and the frame settings only change for a modelled goodput
+// HARQ_MARGIN (relative) better than the current one. The estimate
+// starts from HARQ_PRIOR_ERRORS errors at HARQ_START_RATE.
+#define HARQ_HISTORY 64
+#define HARQ_MARGIN 0.005
+#define HARQ_MIN_PAYLOAD 128
+#define HARQ_MIN_RATE 1e-7
+#define HARQ_START_RATE 1e-3
+#define HARQ_PRIOR_ERRORS 0.1
 
-static int g_role = 0;
-static int g_timeout = 0;
-static int g_nretrans = 0;
-static uint8_t g_tx_ns = 0;      
-static uint8_t g_rx_expected = 0;
+// Transmit window slot: an I-frame sent but not yet acknowledged.
+// Each frame is kept as header, stuffed body and trailer (stuffed frame
+// check sequence and the closing FLAG) and written with a single writev().
+typedef struct {
+    unsigned char header[5];
+    unsigned char *body;
+    unsigned char trailer[9];
+    int header_len;
+    int body_len;
+    int trailer_len;
+    int size;
+    int fec;           // Check bytes per codeword it was encoded with
+    unsigned char *data; // Its payload, kept to encode it again (hybrid ARQ)
+    int sends;
+    int attempts;      // Sends counted against the retransmissions allowed
+    int64_t done_at;   // When the last copy is expected to be on the wire
+} TxSlot;
 
-// Alarm handler used for retransmissions
-static void alarm_handler(int signo) {
-    (void)signo;
-    alarm_fired = 1;
+// Outcome of one frame sent, for the hybrid ARQ error estimate
+typedef struct {
+    int payload;
+    int fec;
+    int bytes;  // On the wire
+    int errors; // Bytes the receiver corrected
+    int lost;
+} HarqSample;
+
+// Receive window slot: a frame accepted (and acknowledged) but not yet
+// returned by llread(), possibly out of order.
+typedef struct {
+    unsigned char *data;
+    int len;
+    int ready;
+    int rejected;
+} RxSlot;
+
+// Everything one link needs. Nothing lives in globals, so a process can
+// drive as many links as it opens.
+struct ll_ctx {
+    SerialPort port;
+
+    // Retransmission timer: a timerfd polled together with the serial port
+    int timerfd;
+    int timer_fired;
+
+    int role;
+    uint8_t addr;      // Address of the frames this end sends
+    uint8_t peer_addr; // Address of the frames the peer sends
+    int timeout;
+    int nretrans;
+    int baud;
+
+    // Round-trip estimate (Jacobson / Karels), in microseconds
+    int64_t srtt;
+    int64_t rttvar;
+    int64_t rto;
+    unsigned long rtt_samples;
+    int64_t line_free; // When the last byte written leaves the port
+
+    // Negotiated window size and the matching sequence number space
+    int window;
+    int fcs;
+    int scramble;      // I-frames carry a key byte and their data XORed with it
+    int fec;           // Reed-Solomon check bytes per codeword of I-frames (0 = none),
+                       // or the most hybrid ARQ may use
+    int adaptive;      // Hybrid ARQ: I-frames carry their own check bytes count
+    int seq_shift;
+    uint32_t seq_mod;
+
+    // UA sent by the receiver, kept to answer a retransmitted SET
+    unsigned char ua[MAX_PARAMS_SIZE * 2 + 8];
+    int ua_len;
+
+    // Transmit window. Sequence numbers are kept as free-running counters;
+    // only the low bits (modulo seq_mod) go on the wire.
+    TxSlot tx[LL_MAX_WINDOW];
+    uint32_t tx_base;   // Oldest unacknowledged frame
+    uint32_t tx_next;   // Next frame to send
+
+    // Receive window
+    RxSlot rx[LL_MAX_WINDOW];
+    uint32_t rx_deliver;   // Next frame llread() returns
+    uint32_t rx_expected;  // First frame not yet received
+
+    // Receive buffers, sized at runtime for the negotiated maximum payload
+    int max_payload;
+    int frame_cap;
+    unsigned char *frame;     // Frame being received, still stuffed
+    unsigned char *destuffed; // Its information field
+    unsigned char *txinfo;    // Information field being sent, before stuffing
+
+    // Escapes the scrambler kept off the wire (transmitter)
+    unsigned long escapes_sent;
+    unsigned long escapes_avoided;
+
+    // Reed-Solomon decoding (receiver)
+    unsigned long fec_bytes;  // Bytes corrected
+    unsigned long fec_frames; // Frames that needed it
+    unsigned long fec_failed; // Frames beyond repair
+    int last_corrected;       // In the last I-frame, reported back in RR
+
+    // Hybrid ARQ (transmitter). The settings new frames get are atomic, as
+    // llframesize_ctx() / llfit_ctx() / llpayload_ctx() read them from any
+    // thread.
+    atomic_int fec_now;     // Check bytes per codeword
+    atomic_int payload_now; // Payload per frame asked of the application
+    HarqSample harq[HARQ_HISTORY];
+    int harq_count;
+    int harq_next;
+    long harq_bytes;  // Sums over the frames kept that got through
+    long harq_errors;
+    int harq_lost;    // Frames kept that were lost
+    unsigned long harq_changes;
+
+    // Bytes of the frame being received, kept across reads that return
+    // before it is complete. 0 right after a FLAG: if the closing FLAG of a
+    // frame was lost to noise, the FLAG that ended the previous frame may
+    // open the next one. -1 while hunting for a FLAG.
+    int frame_len;
+    unsigned long frames_read;
+
+    // Statistics (llstats_ctx() fills in the rest when asked)
+    LinkLayerStats stats;
+    unsigned long long stuff_in;  // I-frame bodies before stuffing
+    unsigned long long stuff_out; // and after
+    int64_t opened_at;
+    char port_name[50];
+    char stats_file[256];
+
+    // Trace of the link, when kept (trace.h)
+    TraceRing *trace;
+    char trace_file[256];
+};
+
+// Link driven by the single-link API (llopen(), llwrite(), ...)
+static ll_ctx *default_link = NULL;
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Account for nbytes just written: they leave the port (10 bits per byte)
+// after whatever is still queued ahead of them.
+// Returns when the last of them is expected to be on the wire.
+static int64_t line_written(ll_ctx *c, int nbytes) {
+    int64_t now = now_us();
+    if (c->line_free < now) c->line_free = now;
+    if (c->baud > 0) c->line_free += (int64_t)nbytes * 10 * 1000000 / c->baud;
+    return c->line_free;
+}
+
+static void rto_reset(ll_ctx *c) {
+    c->srtt = c->rttvar = 0;
+    c->rtt_samples = 0;
+    c->line_free = 0;
+    c->rto = (int64_t)c->timeout * 1000000;
+}
+
+static void rto_clamp(ll_ctx *c) {
+    int64_t max = (int64_t)c->timeout * 1000000;
+    if (c->rto < MIN_RTO_US) c->rto = MIN_RTO_US;
+    if (c->rto > max) c->rto = max;
+}
+
+// Feed a round-trip sample (RFC 6298), measured from the moment the frame
+// was fully on the wire. Only frames sent once may be sampled (Karn's
+// rule), so an acknowledgement is never matched to the wrong copy.
+static void rtt_sample(ll_ctx *c, int64_t done_at) {
+    int64_t rtt = now_us() - done_at;
+    if (rtt < 0) rtt = 0;
+    histRecord(&c->stats.rtt, rtt);
+    if (c->rtt_samples++ == 0) {
+        c->srtt = rtt;
+        c->rttvar = rtt / 2;
+    } else {
+        int64_t err = c->srtt - rtt;
+        c->rttvar += ((err < 0 ? -err : err) - c->rttvar) / 4;
+        c->srtt += (rtt - c->srtt) / 8;
+    }
+    c->rto = c->srtt + (4 * c->rttvar > CLOCK_G_US ? 4 * c->rttvar : CLOCK_G_US);
+    rto_clamp(c);
+}
+
+// Exponential backoff after a timeout, kept until the next valid sample
+static void rto_backoff(ll_ctx *c) {
+    c->rto *= 2;
+    rto_clamp(c);
+}
+
+// Fire the timer us microseconds from now
+static void timer_arm(ll_ctx *c, int64_t us) {
+    struct itimerspec it = {0};
+    it.it_value.tv_sec = us / 1000000;
+    it.it_value.tv_nsec = (us % 1000000) * 1000;
+    c->timer_fired = 0;
+    timerfd_settime(c->timerfd, 0, &it, NULL);
+}
+
+// Arm the retransmission timer to fire one RTO after the frame being
+// acknowledged is expected to be on the wire
+static void timer_start(ll_ctx *c, int64_t done_at) {
+    int64_t wait = done_at - now_us();
+    timer_arm(c, c->rto + (wait > 0 ? wait : 0));
+}
+
+static void timer_stop(ll_ctx *c) {
+    struct itimerspec it = {0};
+    timerfd_settime(c->timerfd, 0, &it, NULL);
+    c->timer_fired = 0;
+}
+
+// Block until the serial port has bytes to read or the timer expires.
+// Nothing is read from the port here, so no byte is lost to a timeout.
+// Returns 0 when bytes are available, or -1 on a timeout (timer_fired is
+// set) or a poll error.
+static int wait_port(ll_ctx *c) {
+    if (bufferedSerialPort(&c->port) > 0) return 0;
+    struct pollfd fds[2] = {
+        { getSerialPortFd(&c->port), POLLIN, 0 },
+        { c->timerfd, POLLIN, 0 },
+    };
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(c->timerfd, &expirations, sizeof(expirations)) > 0) {
+                c->timer_fired = 1;
+                return -1;
+            }
+        }
+        if (fds[0].revents) return 0;
+    }
+}
+
+// Check without blocking for received bytes or, with timer, an expired
+// retransmission timer.
+static int pending_event(ll_ctx *c, int timer) {
+    if (bufferedSerialPort(&c->port) > 0) return 1;
+    struct pollfd fds[2] = {
+        { getSerialPortFd(&c->port), POLLIN, 0 },
+        { c->timerfd, POLLIN, 0 },
+    };
+    return poll(fds, timer ? 2 : 1, 0) > 0;
 }
 
 // Compute BCC1 = A ^ C
@@ -69,327 +337,1110 @@ static uint8_t bcc2(const uint8_t *buf, int len) {
     return x;
 }
 
-static int stuff(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
-    int p = 0;
-    for (int i = 0; i < inlen; ++i) {
-        unsigned char c = in[i];
-        if (c == FLAG || c == ESC) {
-            if (p + 2 > outcap) return -1;
-            out[p++] = ESC;
-            out[p++] = c ^ ESC_XOR;
-        } else {
-            if (p + 1 > outcap) return -1;
-            out[p++] = c;
+static const char *fcs_name(int fcs) {
+    switch (fcs) {
+        case LlFcsCrc16: return "CRC-16";
+        case LlFcsCrc32: return "CRC-32";
+        case LlFcsCrc32c: return "CRC-32C";
+        default: return "XOR";
+    }
+}
+
+// Bytes of the frame check sequence. S / U frames (SET / UA parameters)
+// always carry the one-byte XOR BCC2.
+static int fcs_size(int fcs) {
+    switch (fcs) {
+        case LlFcsCrc16: return 2;
+        case LlFcsCrc32:
+        case LlFcsCrc32c: return 4;
+        default: return 1;
+    }
+}
+
+static uint32_t fcs_compute(int fcs, const unsigned char *buf, int len) {
+    switch (fcs) {
+        case LlFcsCrc16: return crc16(buf, len);
+        case LlFcsCrc32: return crc32(buf, len);
+        case LlFcsCrc32c: return crc32c(buf, len);
+        default: return bcc2(buf, len);
+    }
+}
+
+// Scrambler: the bytes that need escaping after XOR with key k are
+// FLAG ^ k and ESC ^ k. Those pairs split the 256 byte values into 128,
+// so the key that escapes the fewest bytes of a frame escapes at most
+// len / 128 of them, whatever the data.
+static int escapes_with_key(const uint32_t *hist, int k) {
+    return hist[FLAG ^ k] + hist[ESC ^ k];
+}
+
+// Best key for len bytes of buf; its escapes go to *escapes and the escapes
+// without scrambling to *plain
+static uint8_t scramble_key(const unsigned char *buf, int len, int *escapes, int *plain) {
+    uint32_t hist[256] = {0};
+    for (int i = 0; i < len; ++i) hist[buf[i]]++;
+    int best = 0;
+    *plain = *escapes = escapes_with_key(hist, 0);
+    for (int k = 1; k < 256 && *escapes > 0; ++k) {
+        int n = escapes_with_key(hist, k);
+        if (n < *escapes) {
+            *escapes = n;
+            best = k;
         }
     }
-    return p;
+    return (uint8_t)best;
 }
 
-static int destuff(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
-    int p = 0;
-    for (int i = 0; i < inlen; ++i) {
-        unsigned char c = in[i];
-        if (c == ESC) {
-            if (i + 1 >= inlen) return -1;
-            unsigned char r = in[++i] ^ ESC_XOR;
-            if (p + 1 > outcap) return -1;
-            out[p++] = r;
-        } else {
-            if (p + 1 > outcap) return -1;
-            out[p++] = c;
+static void xor_bytes(unsigned char *out, const unsigned char *in, int len, uint8_t key) {
+    for (int i = 0; i < len; ++i) out[i] = in[i] ^ key;
+}
+
+// Reed-Solomon codewords with fec check bytes each that protect len bytes
+static int fec_blocks(int fec, int len) {
+    int k = RS_BLOCK - fec;
+    return (len + k - 1) / k;
+}
+
+// Longest information field for payloads of up to maxPayload bytes:
+// scrambler key, payload, FCS and check bytes (hybrid ARQ never uses more
+// than the negotiated count)
+static int info_cap(ll_ctx *c, int maxPayload) {
+    int len = 1 + maxPayload + 4;
+    return c->fec ? len + c->fec * fec_blocks(c->fec, len) : len;
+}
+
+// FEC: the len bytes of an information field are spread over the fewest
+// codewords that hold them, byte i going to codeword i % blocks, so a burst
+// of errors is shared out between them. The check bytes of each codeword
+// follow the field in turn. Returns the length with the check bytes.
+static int fec_encode(unsigned char *info, int len, int fec) {
+    int blocks = fec_blocks(fec, len);
+    unsigned char cw[RS_BLOCK];
+    for (int j = 0; j < blocks; ++j) {
+        int n = 0;
+        for (int i = j; i < len; i += blocks) cw[n++] = info[i];
+        rsEncode(cw, n, info + len + j * fec, fec);
+    }
+    return len + blocks * fec;
+}
+
+// Correct a received information field of len bytes with fec check bytes
+// per codeword in place.
+// Returns its length without the check bytes or -1 if it is beyond repair.
+static int fec_decode(ll_ctx *c, unsigned char *info, int len, int fec) {
+    int blocks = (len + RS_BLOCK - 1) / RS_BLOCK;
+    int data = len - blocks * fec;
+    if (data < 1 || fec_blocks(fec, data) != blocks) return -1;
+
+    unsigned char cw[RS_BLOCK];
+    int corrected = 0;
+    for (int j = 0; j < blocks; ++j) {
+        int n = 0;
+        for (int i = j; i < data; i += blocks) cw[n++] = info[i];
+        int fixed = rsDecode(cw, n, info + data + j * fec, fec);
+        if (fixed < 0) {
+            c->fec_failed++;
+            return -1;
         }
+        if (fixed == 0) continue;
+        n = 0;
+        for (int i = j; i < data; i += blocks) info[i] = cw[n++];
+        corrected += fixed;
     }
-    return p;
+    if (corrected > 0) {
+        c->fec_bytes += corrected;
+        c->fec_frames++;
+    }
+    c->last_corrected = corrected;
+    return data;
+}
+
+// Select stop-and-wait (window 1) or the windowed sequence space and reset
+// both windows.
+static void set_window(ll_ctx *c, int window) {
+    if (window < 1) window = 1;
+    if (window > LL_MAX_WINDOW) window = LL_MAX_WINDOW;
+    c->window = window;
+    c->seq_shift = (window == 1) ? SEQ_SHIFT_SW : SEQ_SHIFT_WIN;
+    c->seq_mod = 1u << (8 - c->seq_shift);
+    c->tx_base = c->tx_next = 0;
+    c->rx_deliver = c->rx_expected = 0;
+    for (int i = 0; i < LL_MAX_WINDOW; ++i) {
+        c->rx[i].ready = 0;
+        c->rx[i].rejected = 0;
+    }
+}
+
+static void free_buffers(ll_ctx *c) {
+    free(c->frame);
+    free(c->destuffed);
+    free(c->txinfo);
+    c->frame = c->destuffed = c->txinfo = NULL;
+    for (int i = 0; i < LL_MAX_WINDOW; ++i) {
+        free(c->tx[i].body);
+        free(c->tx[i].data);
+        free(c->rx[i].data);
+        c->tx[i].body = c->tx[i].data = NULL;
+        c->rx[i].data = NULL;
+    }
+}
+
+// Release everything llopen() set up
+static void close_link(ll_ctx *c) {
+    free_buffers(c);
+    if (c->timerfd >= 0) close(c->timerfd);
+    c->timerfd = -1;
+    closeSerialPort(&c->port);
+}
+
+// Size the receive buffer and the slots of the current window for payloads
+// of up to maxPayload bytes (stuffing may double them).
+// Returns 0 on success or -1 if out of memory.
+static int alloc_buffers(ll_ctx *c, int maxPayload) {
+    free_buffers(c);
+    if (c->frame_len > 0) c->frame_len = -1; // A partial frame is lost with its buffer
+    c->max_payload = maxPayload;
+    c->frame_cap = 4 + 2 * info_cap(c, maxPayload);
+    c->frame = malloc(c->frame_cap);
+    c->destuffed = malloc(c->frame_cap);
+    c->txinfo = malloc(info_cap(c, maxPayload));
+    if (!c->frame || !c->destuffed || !c->txinfo) return -1;
+    for (int i = 0; i < c->window; ++i) {
+        c->tx[i].body = malloc(2 * info_cap(c, maxPayload));
+        c->rx[i].data = malloc(maxPayload);
+        if (!c->tx[i].body || !c->rx[i].data) return -1;
+        if (c->adaptive && !(c->tx[i].data = malloc(maxPayload))) return -1;
+    }
+    return 0;
+}
+
+static uint8_t ctrl(ll_ctx *c, uint8_t type, uint32_t seq) {
+    return (uint8_t)(type | ((seq % c->seq_mod) << c->seq_shift));
+}
+
+static uint8_t ctrl_type(ll_ctx *c, uint8_t C) {
+    return (uint8_t)(C & ((1 << c->seq_shift) - 1));
+}
+
+// Distance from the counter "base" to the wire sequence number in C
+static uint32_t seq_dist(ll_ctx *c, uint8_t C, uint32_t base) {
+    uint32_t seq = (uint32_t)(C >> c->seq_shift);
+    return (seq + c->seq_mod - base % c->seq_mod) % c->seq_mod;
+}
+
+static void build_header(unsigned char *h, uint8_t A, uint8_t C) {
+    h[0] = FLAG;
+    h[1] = A;
+    h[2] = C;
+    h[3] = bcc1(A, C);
+}
+
+// Stuffed frame check sequence (size bytes, least significant first)
+// followed by the closing FLAG; returns the trailer length
+static int build_trailer(unsigned char *t, uint32_t fcs, int size) {
+    unsigned char raw[4];
+    for (int i = 0; i < size; ++i) raw[i] = (unsigned char)(fcs >> (8 * i));
+    int n = stuffBytes(raw, size, t, 2 * size, NULL);
+    t[n++] = FLAG;
+    return n;
+}
+
+// Build FLAG A C BCC1 [D1..Dn BCC2] FLAG into out. The information field
+// is omitted when data is NULL.
+// Returns the frame length or -1 if it does not fit in outcap.
+static int build_frame(unsigned char *out, int outcap, uint8_t A, uint8_t C,
+                       const unsigned char *data, int len) {
+    int pos = 4;
+    build_header(out, A, C);
+
+    if (data) {
+        uint8_t bcc = 0;
+        int stuffed_len = stuffBytes(data, len, out + pos, outcap - pos - 3, &bcc);
+        if (stuffed_len < 0) return -1;
+        pos += stuffed_len;
+        return pos + build_trailer(out + pos, bcc, 1);
+    }
+
+    out[pos++] = FLAG;
+    return pos;
 }
 
 // Write a supervision frame: FLAG A C BCC FLAG
-static int send_su(uint8_t A_field, uint8_t C_field) {
+static int send_su(ll_ctx *c, uint8_t A_field, uint8_t C_field) {
     unsigned char f[5];
     f[0] = FLAG; f[1] = A_field; f[2] = C_field; f[3] = bcc1(A_field, C_field); f[4] = FLAG;
-    int w = writeBytesSerialPort(f, 5);
+    int w = writeBytesSerialPort(&c->port, f, 5);
     return (w == 5) ? 0 : -1;
 }
 
-// Read a supervision frame (blocking)
-static int read_su(uint8_t expectedA, uint8_t *Cout) {
-    enum { ST_START, ST_FLAG, ST_A, ST_C, ST_BCC } st = ST_START;
-    unsigned char b;
-    unsigned char A = 0, C = 0, B = 0;
+// Check bytes per codeword: an even count up to RS_MAX_PARITY, or 0
+static int valid_fec(int fec) {
+    return fec >= 0 && fec <= RS_MAX_PARITY && fec % 2 == 0;
+}
+
+// Acknowledge with RR(seq). With hybrid ARQ the RR carries one byte: the
+// bytes FEC corrected in the last I-frame, so the transmitter sees the
+// errors its check bytes absorb.
+static int send_rr(ll_ctx *c, uint32_t seq) {
+    TRACE(TRACE_FRAMES, c->trace, TrRrSent, seq, 0);
+    if (!c->adaptive) return send_su(c, c->addr, ctrl(c, C_RR, seq));
+    unsigned char f[9];
+    unsigned char corrected = (unsigned char)(c->last_corrected < 255 ? c->last_corrected : 255);
+    int len = build_frame(f, sizeof(f), c->addr, ctrl(c, C_RR, seq), &corrected, 1);
+    return writeBytesSerialPort(&c->port, f, len) == len ? 0 : -1;
+}
+
+// Check the frame of blen bytes just read into c->frame (without its
+// FLAGs) and destuff its information field, for read_frame().
+// Returns the information field length or -1 if the frame is bad.
+static int check_frame(ll_ctx *c, int blen, uint8_t *Cout, const unsigned char **data) {
+    unsigned char *body = c->frame;
+    if (blen < 3) return -1;
+    unsigned char A = body[0];
+    unsigned char C = body[1];
+    int iframe = ctrl_type(c, C) == C_I;
+    // With hybrid ARQ, I-frames name their check bytes count before BCC1
+    int hlen = iframe && c->adaptive ? 3 : 2;
+    int fec = !iframe ? 0 : c->adaptive ? body[2] : c->fec;
+    if (blen < hlen + 1) return -1;
+    if (body[hlen] != (unsigned char)(A ^ C ^ (hlen == 3 ? fec : 0))) return -1;
+    if (fec > c->fec || !valid_fec(fec)) return -1;
+
+    int stuffed_len = blen - hlen - 1;
+    if (stuffed_len < 1 || !data) {
+        if (Cout) *Cout = C;
+        return 0;
+    }
+    unsigned char *destuffed = c->destuffed;
+    int dlen = destuffBytes(body + hlen + 1, stuffed_len, destuffed, c->frame_cap);
+    int fcs = iframe ? c->fcs : LlFcsXor;
+    int check_len = fcs_size(fcs);
+    c->last_corrected = 0;
+    if (fec && dlen >= 0) {
+        // Repair the field before anything else looks at it
+        dlen = fec_decode(c, destuffed, dlen, fec);
+        if (dlen < 0) return -1;
+    }
+    if (iframe && c->scramble) {
+        // Key, then the data XORed with it; the FCS covers the data itself
+        if (dlen < 1 + check_len) return -1;
+        uint8_t key = *destuffed++;
+        dlen--;
+        xor_bytes(destuffed, destuffed, dlen - check_len, key);
+    }
+    if (dlen < check_len) return -1;
+    int payload_len = dlen - check_len;
+    uint32_t recv_fcs = 0;
+    for (int i = 0; i < check_len; ++i) recv_fcs |= (uint32_t)destuffed[payload_len + i] << (8 * i);
+    if (fcs_compute(fcs, destuffed, payload_len) != recv_fcs) return -1;
+    if (payload_len > c->max_payload) return -1;
+    *data = destuffed;
+    if (Cout) *Cout = C;
+    return payload_len;
+}
+
+// Read one frame addressed to expectedA. Frames for the other address are
+// skipped; a FLAG always starts a new frame, so the reader resynchronises
+// by itself after noise. An information field is destuffed and checked;
+// *data then points to it until the next read (when data is NULL the
+// field is dropped). Without block, return READ_AGAIN once the port has
+// no more bytes and the timer has not expired; the partial frame is kept
+// for the next call.
+// Returns the information field length (0 for S / U frames) or -1 on error
+// (bad BCC, oversized frame, or the retransmission timer expired).
+static int read_frame(ll_ctx *c, uint8_t expectedA, uint8_t *Cout, const unsigned char **data, int block) {
+    unsigned char *body = c->frame;
     while (1) {
-        int r = readByteSerialPort(&b);
-        if (r < 0) return -1;
-        if (r == 0) continue;
-        switch (st) {
-            case ST_START:
-                if (b == FLAG) st = ST_FLAG;
-                break;
-            case ST_FLAG:
-                if (b == expectedA) { A = b; st = ST_A; }
-                else if (b != FLAG) st = ST_START;
-                break;
-            case ST_A:
-                C = b; st = ST_C; break;
-            case ST_C:
-                B = b; st = ST_BCC; break;
-            case ST_BCC:
-                if (b == FLAG) {
-                    if (B == (uint8_t)(A ^ C)) {
-                        if (Cout) *Cout = C;
-                        return 0;
-                    } else {
-                        return -1;
-                    }
-                } else {
-                    st = ST_START;
-                }
-                break;
+        // Take whole runs of buffered bytes up to the next FLAG at a time
+        const unsigned char *p;
+        if (!block && !pending_event(c, 1)) return READ_AGAIN;
+        if (wait_port(c) < 0) return -1;
+        int n = peekSerialPort(&c->port, &p);
+        if (n < 0) return -1;
+        if (n == 0) continue;
+        const unsigned char *f = memchr(p, FLAG, n);
+        int run = f ? (int)(f - p) : n;
+        if (c->frame_len >= 0 && run > 0) {
+            if (c->frame_len + run > c->frame_cap) {
+                consumeSerialPort(&c->port, run);
+                c->frame_len = -1;
+                c->stats.badFrames++;
+                TRACE(TRACE_EVENTS, c->trace, TrBadFrame, 0, c->frame_cap);
+                return -1;
+            }
+            memcpy(body + c->frame_len, p, run);
+            c->frame_len += run;
         }
+        if (!f) {
+            consumeSerialPort(&c->port, n);
+            continue;
+        }
+        consumeSerialPort(&c->port, run + 1);
+        if (c->frame_len > 0 && body[0] == expectedA) break;
+        c->frame_len = 0;
+    }
+    int blen = c->frame_len;
+    c->frame_len = 0;
+    c->frames_read++;
+
+    int r = check_frame(c, blen, Cout, data);
+    if (r < 0) {
+        c->stats.badFrames++;
+        TRACE(TRACE_EVENTS, c->trace, TrBadFrame, 0, blen);
     }
-    return -1;
+    return r;
 }
 
-static void flush_until_flag() {
-    unsigned char b;
-    int flushCount = 0;
-    do {
-        int r = readByteSerialPort(&b);
-        if (r <= 0) break;
-        flushCount++;
-    } while (b != FLAG && flushCount < FLUSH_LIMIT);
+// Read a supervision / unnumbered frame (blocking)
+static int read_su(ll_ctx *c, uint8_t expectedA, uint8_t *Cout) {
+    return read_frame(c, expectedA, Cout, NULL, 1);
 }
 
-// Read an I-frame:
-static int read_iframe(uint8_t expectedA, uint8_t *Cout, unsigned char *out, int outcap) {
-    unsigned char b;
-    while (1) {
-        int r = readByteSerialPort(&b);
-        if (r < 0) return -1;
-        if (r == 0) continue;
-        if (b == FLAG) break;
+static int clamp_payload(int maxPayload) {
+    if (maxPayload < LL_MIN_PAYLOAD_SIZE) return LL_MIN_PAYLOAD_SIZE;
+    if (maxPayload > LL_MAX_PAYLOAD_LIMIT) return LL_MAX_PAYLOAD_LIMIT;
+    return maxPayload;
+}
+
+// Encode the link parameters proposed in SET / accepted in UA
+static int build_params(unsigned char *p, int window, int fcs, int maxPayload, int scramble, int fec,
+                        int adaptive) {
+    int index = 0;
+    p[index++] = PARAM_MAX_PAYLOAD;
+    p[index++] = 4;
+    uint32_t be_max = htonl((uint32_t)maxPayload);
+    memcpy(&p[index], &be_max, 4);
+    index += 4;
+    p[index++] = PARAM_WINDOW;
+    p[index++] = 1;
+    p[index++] = (unsigned char)window;
+    p[index++] = PARAM_FCS;
+    p[index++] = 1;
+    p[index++] = (unsigned char)fcs;
+    if (scramble) {
+        p[index++] = PARAM_SCRAMBLE;
+        p[index++] = 1;
+        p[index++] = 1;
+    }
+    if (fec) {
+        p[index++] = PARAM_FEC;
+        p[index++] = 1;
+        p[index++] = (unsigned char)fec;
     }
+    if (adaptive) {
+        p[index++] = PARAM_HARQ;
+        p[index++] = 1;
+        p[index++] = 1;
+    }
+    return index;
+}
 
-    unsigned char body[MAX_FRAME_SIZE];
-    int blen = 0;
-    while (1) {
-        int r = readByteSerialPort(&b);
-        if (r < 0) { flush_until_flag(); return -1; }
-        if (r == 0) continue;
-        if (b == FLAG) break;
-        if (blen >= (int)sizeof(body)) { flush_until_flag(); return -1; }
-        body[blen++] = b;
+// Decode link parameters, skipping unknown types. A peer that sends no
+// parameters only speaks stop-and-wait with the XOR BCC2 and the default
+// MAX_PAYLOAD_SIZE, without the scrambler, FEC or hybrid ARQ.
+static void parse_params(const unsigned char *p, int len, int *window, int *fcs, int *maxPayload,
+                         int *scramble, int *fec, int *adaptive) {
+    *window = 1;
+    *fcs = LlFcsXor;
+    *maxPayload = MAX_PAYLOAD_SIZE;
+    *scramble = 0;
+    *fec = 0;
+    *adaptive = 0;
+    int index = 0;
+    while (index + 2 <= len) {
+        unsigned char T = p[index];
+        unsigned char L = p[index + 1];
+        const unsigned char *V = &p[index + 2];
+        if (index + 2 + L > len) break;
+        if (T == PARAM_WINDOW && L == 1) *window = V[0];
+        if (T == PARAM_FCS && L == 1 && V[0] <= LlFcsCrc32c) *fcs = V[0];
+        if (T == PARAM_SCRAMBLE && L == 1) *scramble = V[0] == 1;
+        if (T == PARAM_FEC && L == 1 && valid_fec(V[0])) *fec = V[0];
+        if (T == PARAM_HARQ && L == 1) *adaptive = V[0] == 1;
+        if (T == PARAM_MAX_PAYLOAD && L == 4) {
+            uint32_t be_max;
+            memcpy(&be_max, V, 4);
+            *maxPayload = clamp_payload((int)ntohl(be_max));
+        }
+        index += 2 + L;
     }
+}
 
-    if (blen < 4) { flush_until_flag(); return -1; }
-    unsigned char A = body[0];
-    unsigned char C = body[1];
-    unsigned char B1 = body[2];
-    if (A != expectedA) { flush_until_flag(); return -1; }
-    if (B1 != (unsigned char)(A ^ C)) { flush_until_flag(); return -1; }
+////////////////////////////////////////////////
+// HYBRID ARQ
+////////////////////////////////////////////////
+// x^n
+static double power(double x, int n) {
+    double r = 1.0;
+    for (; n > 0; n >>= 1, x *= x)
+        if (n & 1) r *= x;
+    return r;
+}
 
-    int stuffed_len = blen - 3;
-    if (stuffed_len < 1) {
-        if (Cout) *Cout = C;
+// Probability that at most t of n bytes are wrong at byte error rate p
+static double at_most(double p, int n, int t) {
+    double term = power(1.0 - p, n);
+    double sum = term;
+    for (int k = 0; k < t && k < n; ++k) {
+        term *= (double)(n - k) / (k + 1) * p / (1.0 - p);
+        sum += term;
+    }
+    return sum;
+}
+
+// Probability that a frame of payload bytes with fec check bytes per
+// codeword gets through at byte error rate p; *wire is set to its length.
+// Stuffing is left out (the scrambler keeps it low). A wrong byte that
+// turns into a FLAG or an ESC breaks the framing, which no check bytes
+// repair.
+static double harq_frame(ll_ctx *c, double p, int payload, int fec, int *wire) {
+    int info = (c->scramble ? 1 : 0) + payload + fcs_size(c->fcs);
+    int bytes = 6 + info; // FLAG A C F BCC1 ... FLAG
+    double ok;
+    if (fec) {
+        int blocks = fec_blocks(fec, info);
+        bytes += fec * blocks;
+        ok = power(1.0 - p, 6) * power(at_most(p, (info + blocks - 1) / blocks + fec, fec / 2), blocks);
+    } else {
+        ok = power(1.0 - p, bytes);
+    }
+    if (wire) *wire = bytes;
+    return ok * power(1.0 - p * 2 / 256, bytes - 6);
+}
+
+// Modelled goodput: payload bytes per byte on the wire, net of the frames
+// lost
+static double harq_goodput(ll_ctx *c, double p, int payload, int fec) {
+    int wire;
+    double ok = harq_frame(c, p, payload, fec, &wire);
+    return ok * payload / wire;
+}
+
+// Byte error rate over the frames kept: the rate the receiver corrected in
+// those that got through, on top of the prior (a few clean frames do not
+// make a clean line), raised until the model loses as many frames as were
+// rejected (less a half, so a single loss does not call for a sure one).
+// The corrections alone miss what bare frames hide and what made frames
+// beyond repair; the losses alone say little once FEC takes them away.
+static double harq_estimate(ll_ctx *c) {
+    double p = (c->harq_errors + HARQ_PRIOR_ERRORS) / (c->harq_bytes + HARQ_PRIOR_ERRORS / HARQ_START_RATE);
+    if (c->harq_lost == 0) return p;
+    for (double q = HARQ_MIN_RATE; q < 0.5; q *= 1.25) {
+        if (q <= p) continue;
+        double expected = 0.0;
+        for (int i = 0; i < c->harq_count; ++i)
+            expected += 1.0 - harq_frame(c, q, c->harq[i].payload, c->harq[i].fec, NULL);
+        if (expected >= c->harq_lost - 0.5) return q;
+    }
+    return 0.5;
+}
+
+// Check bytes count to try after f: 0, 2, 4, 8, ... and the negotiated
+// count last (past it after that)
+static int next_fec(ll_ctx *c, int f) {
+    if (f >= c->fec) return c->fec + 1;
+    f = f ? 2 * f : 2;
+    return f < c->fec ? f : c->fec;
+}
+
+// Find the check bytes count (0, then powers of two up to the negotiated
+// count) and payload size (halving from the maximum) with the best
+// modelled goodput at byte error rate p; returns that goodput
+static double harq_best(ll_ctx *c, double p, int *fec, int *payload) {
+    double best = -1.0;
+    for (int f = 0; f <= c->fec; f = next_fec(c, f)) {
+        for (int n = c->max_payload; n >= HARQ_MIN_PAYLOAD; n /= 2) {
+            double g = harq_goodput(c, p, n, f);
+            if (g > best) {
+                best = g;
+                *fec = f;
+                *payload = n;
+            }
+        }
+    }
+    return best;
+}
+
+// Move to the best frame settings for the byte error rate seen over the
+// last frames, if they are clearly better
+static void harq_adapt(ll_ctx *c) {
+    double p = harq_estimate(c);
+    int fec = atomic_load_explicit(&c->fec_now, memory_order_relaxed);
+    int payload = atomic_load_explicit(&c->payload_now, memory_order_relaxed);
+    double current = harq_goodput(c, p, payload, fec);
+    int bestFec, bestPayload;
+    double best = harq_best(c, p, &bestFec, &bestPayload);
+    if (best <= current * (1.0 + HARQ_MARGIN)) return;
+
+    atomic_store_explicit(&c->fec_now, bestFec, memory_order_relaxed);
+    atomic_store_explicit(&c->payload_now, bestPayload, memory_order_relaxed);
+    c->harq_changes++;
+    TRACE(TRACE_EVENTS, c->trace, TrHarq, bestFec, bestPayload);
+    printf("Hybrid ARQ: byte error rate %.1e, frames of up to %d bytes with %d check bytes per codeword\n",
+           p, bestPayload, bestFec);
+}
+
+// Record the frame in slot s as lost or taken with errors bytes corrected,
+// dropping the oldest frame kept, and adapt the frame settings
+static void harq_sample(ll_ctx *c, TxSlot *s, int errors, int lost) {
+    if (!c->adaptive) return;
+    HarqSample *h = &c->harq[c->harq_next];
+    if (c->harq_count == HARQ_HISTORY) {
+        if (h->lost) c->harq_lost--;
+        else {
+            c->harq_bytes -= h->bytes;
+            c->harq_errors -= h->errors;
+        }
+    } else {
+        c->harq_count++;
+    }
+    h->payload = s->size;
+    h->fec = s->fec;
+    h->bytes = s->header_len + s->body_len + s->trailer_len;
+    h->errors = errors;
+    h->lost = lost;
+    if (lost) c->harq_lost++;
+    else {
+        c->harq_bytes += h->bytes;
+        c->harq_errors += errors;
+    }
+    c->harq_next = (c->harq_next + 1) % HARQ_HISTORY;
+    harq_adapt(c);
+}
+
+// Encode the I-frame with sequence counter seq carrying bufSize bytes of
+// buf into its slot, with fec check bytes per codeword.
+// Returns 0 on success or -1 on error.
+static int encode_iframe(ll_ctx *c, uint32_t seq, const unsigned char *buf, int bufSize, int fec) {
+    TxSlot *s = &c->tx[seq % c->window];
+    uint8_t C = ctrl(c, C_I, seq);
+    build_header(s->header, c->addr, C);
+    s->header_len = 4;
+    if (c->adaptive) {
+        s->header[3] = (unsigned char)fec;
+        s->header[4] = bcc1(c->addr, C) ^ (uint8_t)fec;
+        s->header_len = 5;
+    }
+
+    uint32_t fcs;
+    if (c->scramble || fec) {
+        // Build the whole information field before stuffing it; with FEC the
+        // FCS goes in it too, to be protected with the rest
+        unsigned char *info = c->txinfo;
+        int len = 0;
+        if (c->scramble) {
+            int escapes, plain;
+            uint8_t key = scramble_key(buf, bufSize, &escapes, &plain);
+            info[len++] = key;
+            xor_bytes(info + len, buf, bufSize, key);
+            c->escapes_sent += escapes;
+            c->escapes_avoided += plain - escapes;
+        } else {
+            memcpy(info, buf, bufSize);
+        }
+        len += bufSize;
+        fcs = fcs_compute(c->fcs, buf, bufSize);
+        if (fec) {
+            for (int i = 0; i < fcs_size(c->fcs); ++i) info[len++] = (unsigned char)(fcs >> (8 * i));
+            len = fec_encode(info, len, fec);
+        }
+        s->body_len = stuffBytes(info, len, s->body, 2 * info_cap(c, c->max_payload), NULL);
+        c->stuff_in += len;
+    } else if (c->fcs == LlFcsXor) {
+        // BCC2 is folded in while stuffing
+        uint8_t bcc = 0;
+        s->body_len = stuffBytes(buf, bufSize, s->body, 2 * c->max_payload, &bcc);
+        fcs = bcc;
+        c->stuff_in += bufSize;
+    } else {
+        fcs = fcs_compute(c->fcs, buf, bufSize);
+        s->body_len = stuffBytes(buf, bufSize, s->body, 2 * c->max_payload, NULL);
+        c->stuff_in += bufSize;
+    }
+    if (s->body_len < 0) return -1;
+    c->stuff_out += s->body_len;
+    s->trailer_len = fec ? build_trailer(s->trailer, 0, 0) : build_trailer(s->trailer, fcs, fcs_size(c->fcs));
+    s->fec = fec;
+    return 0;
+}
+
+// writev() the whole iovec, resuming after partial writes and interruptions
+static int writev_all(ll_ctx *c, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        int w = writevSerialPort(&c->port, iov, iovcnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+// (Re)transmit the I-frame with sequence counter seq
+static int send_iframe(ll_ctx *c, uint32_t seq) {
+    TxSlot *s = &c->tx[seq % c->window];
+    TRACE(TRACE_FRAMES, c->trace, s->sends ? TrResend : TrSend, seq, s->size);
+    struct iovec iov[3] = {
+        { s->header, s->header_len },
+        { s->body, s->body_len },
+        { s->trailer, s->trailer_len },
+    };
+    if (writev_all(c, iov, 3) < 0) return -1;
+    s->sends++;
+    c->stats.framesSent++;
+    c->stats.wireBytesSent += s->header_len + s->body_len + s->trailer_len;
+    s->done_at = line_written(c, s->header_len + s->body_len + s->trailer_len);
+    if (seq == c->tx_base) timer_start(c, s->done_at);
+    return 0;
+}
+
+// Resend a lost frame; unless counted, it does not use up a retransmission.
+// With hybrid ARQ it goes out with every check byte negotiated, whatever
+// the estimate: the frame size is already fixed and a second loss costs
+// far more than the extra check bytes.
+static int retransmit(ll_ctx *c, uint32_t seq, int counted) {
+    TxSlot *s = &c->tx[seq % c->window];
+    if (counted && s->attempts >= c->nretrans) {
+        fprintf(stderr, "Frame %u not acknowledged after %d attempts\n",
+                (unsigned)(seq % c->seq_mod), s->attempts);
+        return -1;
+    }
+    if (counted) s->attempts++;
+    if (c->adaptive && s->fec != c->fec && encode_iframe(c, seq, s->data, s->size, c->fec) < 0)
+        return -1;
+    c->stats.retransmissions++;
+    if (send_iframe(c, seq) < 0) return -1;
+    timer_start(c, c->tx[c->tx_base % c->window].done_at);
+    return 0;
+}
+
+// Resend the oldest unacknowledged frame after the timer expired
+static int handle_timeout(ll_ctx *c) {
+    c->timer_fired = 0;
+    if (c->tx_base == c->tx_next) return 0;
+    c->stats.timeouts++;
+    int counted = c->rto >= (int64_t)c->timeout * 1000000;
+    rto_backoff(c);
+    TRACE(TRACE_EVENTS, c->trace, TrTimeout, c->tx_base, c->rto);
+    printf("Timeout (attempt %d/%d%s, RTO now %.1f ms)\n", c->tx[c->tx_base % c->window].attempts,
+           c->nretrans, counted ? "" : ", not counted", c->rto / 1000.0);
+    return retransmit(c, c->tx_base, counted);
+}
+
+// Update the transmit window for an RR / REJ: RR(n) acknowledges every
+// frame before n, REJ(n) asks for frame n only. info holds the len bytes
+// the frame carried (the correction report of hybrid ARQ).
+static int handle_ack(ll_ctx *c, uint8_t rc, const unsigned char *info, int len) {
+    uint32_t outstanding = c->tx_next - c->tx_base;
+    uint32_t d = seq_dist(c, rc, c->tx_base);
+    if (ctrl_type(c, rc) == C_RR) {
+        if (d >= 1 && d <= outstanding) {
+            TRACE(TRACE_FRAMES, c->trace, TrRrReceived, c->tx_base + d, len == 1 ? info[0] : 0);
+            // The newest frame acknowledged is the one this RR answers
+            TxSlot *acked = &c->tx[(c->tx_base + d - 1) % c->window];
+            if (acked->sends == 1) rtt_sample(c, acked->done_at);
+            for (uint32_t i = 0; i < d; ++i)
+                harq_sample(c, &c->tx[(c->tx_base + i) % c->window], i == d - 1 && len == 1 ? info[0] : 0, 0);
+            c->tx_base += d;
+            if (c->tx_base == c->tx_next) timer_stop(c);
+            else timer_start(c, c->tx[c->tx_base % c->window].done_at);
+        }
+    } else if (ctrl_type(c, rc) == C_REJ) {
+        if (d < outstanding) {
+            TxSlot *s = &c->tx[(c->tx_base + d) % c->window];
+            printf("REJ received (attempt %d/%d)\n", s->attempts, c->nretrans);
+            c->stats.rejReceived++;
+            TRACE(TRACE_EVENTS, c->trace, TrRejReceived, c->tx_base + d, 0);
+            // Only a REJ counts as a frame lost to noise for hybrid ARQ: a
+            // timeout may just be a late or lost RR
+            harq_sample(c, s, 0, 1);
+            return retransmit(c, c->tx_base + d, 1);
+        }
+    }
+    return 0;
+}
+
+// Store an in-window I-frame, acknowledge with RR(first missing frame) and
+// ask for the first missing frame with REJ if later frames already arrived.
+static int receive_iframe(ll_ctx *c, uint8_t C, const unsigned char *data, int len) {
+    uint32_t d = seq_dist(c, C, c->rx_expected);
+    if (d >= (uint32_t)c->window) {
+        printf("Duplicated Frame Detected!\nReceived seq:%u but Expected seq:%u...\n",
+               (unsigned)(C >> c->seq_shift), (unsigned)(c->rx_expected % c->seq_mod));
+        printf("Discarding duplicate and resending RR%u.\n", (unsigned)(c->rx_expected % c->seq_mod));
+        c->stats.duplicates++;
+        TRACE(TRACE_EVENTS, c->trace, TrDuplicate, c->rx_expected, 0);
+        return send_rr(c, c->rx_expected);
+    }
+
+    uint32_t seq = c->rx_expected + d;
+    if (seq - c->rx_deliver < (uint32_t)c->window) {
+        RxSlot *s = &c->rx[seq % c->window];
+        if (!s->ready) {
+            if (len > 0) memcpy(s->data, data, len);
+            s->len = len;
+            s->ready = 1;
+            c->stats.framesReceived++;
+            c->stats.bytesReceived += len;
+            TRACE(TRACE_FRAMES, c->trace, TrAccept, seq, len);
+        } else {
+            c->stats.duplicates++;
+            TRACE(TRACE_EVENTS, c->trace, TrDuplicate, c->rx_expected, 0);
+        }
+        while (c->rx_expected - c->rx_deliver < (uint32_t)c->window && c->rx[c->rx_expected % c->window].ready)
+            c->rx_expected++;
+    }
+
+    if (send_rr(c, c->rx_expected) < 0) return -1;
+    if (seq > c->rx_expected && c->rx_expected - c->rx_deliver < (uint32_t)c->window) {
+        RxSlot *missing = &c->rx[c->rx_expected % c->window];
+        if (!missing->rejected) {
+            missing->rejected = 1;
+            printf("Frame %u missing, REJ sent.\n", (unsigned)(c->rx_expected % c->seq_mod));
+            c->stats.rejSent++;
+            TRACE(TRACE_EVENTS, c->trace, TrRejSent, c->rx_expected, 0);
+            return send_su(c, c->addr, ctrl(c, C_REJ, c->rx_expected));
+        }
+    }
+    return 0;
+}
+
+// Wait for one event on the transmit side: an RR / REJ, a timeout (which
+// resends the oldest unacknowledged frame) or an I-frame the peer sends
+// the other way, which is stored for llread(). A bad frame (most likely a
+// corrupted RR / REJ) is only dropped: the timer or the peer's REJ
+// recovers whatever it was.
+// Returns 0 after handling the event, or -1 on a write error, when a frame
+// runs out of retransmissions or the peer disconnects.
+static int wait_ack(ll_ctx *c) {
+    unsigned char rc = 0;
+    const unsigned char *data;
+    int r = c->timer_fired ? -1 : read_frame(c, c->peer_addr, &rc, &data, 1);
+
+    if (r < 0) {
+        if (c->timer_fired) return handle_timeout(c);
         return 0;
     }
-    unsigned char destuffed[MAX_FRAME_SIZE];
-    int dlen = destuff(body + 3, stuffed_len, destuffed, sizeof(destuffed));
-    if (dlen < 1) { flush_until_flag(); return -1; }
-    int payload_len = dlen - 1;
-    unsigned char recv_bcc2 = destuffed[payload_len];
-    unsigned char calc_bcc2 = bcc2(destuffed, payload_len);
-    if (calc_bcc2 != recv_bcc2) { flush_until_flag(); return -1; }
-    if (payload_len > outcap) { flush_until_flag(); return -1; }
-    if (payload_len > 0) memcpy(out, destuffed, payload_len);
-    if (Cout) *Cout = C;
-    return payload_len;
+    if (rc == C_DISC) {
+        timer_stop(c);
+        return -1;
+    }
+    if (ctrl_type(c, rc) == C_I) return receive_iframe(c, rc, data, r);
+    return handle_ack(c, rc, data, r);
 }
 
 ////////////////////////////////////////////////
 // LLOPEN
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters) {
-    STOP = 0;
-    alarm_fired = 0;
+// Open the port and run the SET / UA exchange on a zeroed context.
+// Returns 0 on success or -1 on error, with everything released.
+static int open_link(ll_ctx *c, LinkLayer connectionParameters) {
+    c->timerfd = -1;
 
-    if (openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate) < 0) {
+    if (openSerialPort(&c->port, connectionParameters.serialPort, connectionParameters.baudRate) < 0) {
         perror("openSerialPort");
         return -1;
     }
     printf("Serial port %s opened:\n", connectionParameters.serialPort);
+    c->opened_at = now_us();
+    snprintf(c->port_name, sizeof(c->port_name), "%s", connectionParameters.serialPort);
+    snprintf(c->stats_file, sizeof(c->stats_file), "%s", connectionParameters.statsFile);
+    snprintf(c->trace_file, sizeof(c->trace_file), "%s", connectionParameters.traceFile);
+
+    c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (c->timerfd < 0) {
+        perror("timerfd_create");
+        closeSerialPort(&c->port);
+        return -1;
+    }
 
-    g_role = connectionParameters.role;
-    g_timeout = connectionParameters.timeout;
-    g_nretrans = connectionParameters.nRetransmissions;
-    g_tx_ns = 0;
-    g_rx_expected = 0;
-
-    struct sigaction act = {0};
-    act.sa_handler = alarm_handler;
-    sigemptyset(&act.sa_mask);
-    if (sigaction(SIGALRM, &act, NULL) == -1) {
-        perror("sigaction");
-        closeSerialPort();
+    c->role = connectionParameters.role;
+    c->addr = (c->role == LlTx) ? A_TX : A_RX;
+    c->peer_addr = (c->role == LlTx) ? A_RX : A_TX;
+    c->timeout = connectionParameters.timeout;
+    c->nretrans = connectionParameters.nRetransmissions;
+    c->baud = connectionParameters.baudRate;
+    rto_reset(c);
+    c->frame_len = -1;
+    c->frames_read = 0;
+    set_window(c, 1);
+    c->fcs = LlFcsXor;
+
+    int window = connectionParameters.windowSize;
+    if (window < 1) window = 1;
+    if (window > LL_MAX_WINDOW) window = LL_MAX_WINDOW;
+    int fcs = connectionParameters.fcs;
+    if (fcs < LlFcsXor || fcs > LlFcsCrc32c) fcs = LlFcsXor;
+    int maxPayload = connectionParameters.maxPayloadSize;
+    maxPayload = clamp_payload(maxPayload > 0 ? maxPayload : MAX_PAYLOAD_SIZE);
+    int scramble = connectionParameters.scramble == 1;
+    int fec = valid_fec(connectionParameters.fec) ? connectionParameters.fec : 0;
+    int adaptive = connectionParameters.adaptive == 1;
+
+    // Big enough for SET / UA until the frame size is agreed
+    if (alloc_buffers(c, MAX_PARAMS_SIZE) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        close_link(c);
         return -1;
     }
 
-    if (g_role == LlTx) {
+    unsigned char params[MAX_PARAMS_SIZE];
+    const unsigned char *peer;
+    int plen;
+    int opened = 0;
+
+    if (c->role == LlTx) {
         printf("Sending SET...\n");
-        unsigned char set[5] = {FLAG, A_TX, C_SET, bcc1(A_TX, C_SET), FLAG};
+        unsigned char set[MAX_PARAMS_SIZE * 2 + 8];
+        plen = build_params(params, window, fcs, maxPayload, scramble, fec, adaptive);
+        int setlen = build_frame(set, sizeof(set), A_TX, C_SET, params, plen);
 
         int tries = 0;
-        while (tries < g_nretrans) {
-            alarm_fired = 0;
-            if (writeBytesSerialPort(set, 5) != 5) {
-                closeSerialPort(); return -1;
-            }
-            alarm(g_timeout);
+        while (tries < c->nretrans && !opened) {
+            c->timer_fired = 0;
+            if (writeBytesSerialPort(&c->port, set, setlen) != setlen) break;
+            int64_t done_at = line_written(c, setlen);
+            timer_start(c, done_at);
 
             unsigned char rC = 0;
-            int res = read_su(A_TX, &rC);
-            if (res == 0) {
+            int res = read_frame(c, A_TX, &rC, &peer, 1);
+            if (res >= 0) {
                 if (rC == C_UA) {
-                    alarm(0);
-                    alarm_fired = 0;
-                    printf("UA received.\nLink opened successfully.\n\n");
-                    g_tx_ns = 0;
-                    g_rx_expected = 0;
-                    return 0;
-                } else {
-                    continue;
-                }
-            } else {
-                if (alarm_fired) {
-                    tries++;
-                    alarm(0);
-                    alarm_fired = 0;
-                    printf("Timeout, retransmitting SET (try %d)...\n", tries);
-                    continue;
+                    timer_stop(c);
+                    // The SET / UA exchange gives the first RTT sample
+                    if (tries == 0) rtt_sample(c, done_at);
+                    parse_params(peer, res, &window, &fcs, &maxPayload, &scramble, &fec, &adaptive);
+                    opened = 1;
                 }
-                tries++;
                 continue;
             }
+            if (c->timer_fired) {
+                timer_stop(c);
+                printf("Timeout, retransmitting SET (try %d)...\n", tries + 1);
+            }
+            tries++;
         }
-        closeSerialPort();
-        return -1;
     } else {
-        while (1) {
+        while (!opened) {
             unsigned char rC = 0;
-            int res = read_su(A_TX, &rC);
-            if (res < 0) continue;
-            if (rC == C_SET) {
-                printf("SET received.\nSending UA...\n");
-                if (send_su(A_TX, C_UA) < 0) {
-                    closeSerialPort(); return -1;
-                }
-                printf("Link opened successfully.\n\n");
-                g_tx_ns = 0;
-                g_rx_expected = 0;
-                return 0;
-            }
+            int res = read_frame(c, A_TX, &rC, &peer, 1);
+            if (res < 0 || rC != C_SET) continue;
+            printf("SET received.\nSending UA...\n");
+
+            // Take the smaller window and frame size and the transmitter's
+            // FCS; the scrambler, FEC and hybrid ARQ are only used if both
+            // ends want them, FEC with the transmitter's check bytes (the
+            // most hybrid ARQ may use)
+            int peerWindow, peerMaxPayload, peerScramble, peerFec, peerAdaptive;
+            parse_params(peer, res, &peerWindow, &fcs, &peerMaxPayload, &peerScramble, &peerFec,
+                         &peerAdaptive);
+            if (peerWindow < window) window = peerWindow;
+            if (peerMaxPayload < maxPayload) maxPayload = peerMaxPayload;
+            scramble = scramble && peerScramble;
+            fec = fec ? peerFec : 0;
+            adaptive = adaptive && peerAdaptive;
+
+            // A peer that sent a bare SET gets a bare UA back
+            plen = build_params(params, window, fcs, maxPayload, scramble, fec, adaptive);
+            c->ua_len = build_frame(c->ua, sizeof(c->ua), A_TX, C_UA, res > 0 ? params : NULL, plen);
+            if (writeBytesSerialPort(&c->port, c->ua, c->ua_len) != c->ua_len) break;
+            opened = 1;
         }
     }
+
+    c->fec = opened ? fec : 0;
+    c->adaptive = opened && adaptive;
+    if (!opened || (set_window(c, window), alloc_buffers(c, maxPayload)) < 0) {
+        close_link(c);
+        return -1;
+    }
+    c->fcs = fcs;
+    c->scramble = scramble;
+    int fecNow = c->fec, payloadNow = c->max_payload;
+    if (c->adaptive) harq_best(c, HARQ_START_RATE, &fecNow, &payloadNow);
+    atomic_store(&c->fec_now, fecNow);
+    atomic_store(&c->payload_now, payloadNow);
+    if (c->role == LlTx) printf("UA received.\n");
+    TRACE(TRACE_EVENTS, c->trace, TrOpen, c->window, c->max_payload);
+    printf("Link opened successfully (window: %d, FCS: %s, max payload: %d bytes%s).\n",
+           c->window, fcs_name(c->fcs), c->max_payload, c->scramble ? ", scrambled" : "");
+    if (c->adaptive)
+        printf("Hybrid ARQ: up to %d Reed-Solomon check bytes per codeword, as the line needs "
+               "(starting with %d in frames of up to %d bytes).\n", c->fec, fecNow, payloadNow);
+    else if (c->fec)
+        printf("FEC: Reed-Solomon with %d check bytes per codeword (corrects %d bytes).\n",
+               c->fec, c->fec / 2);
+    printf("\n");
+    return 0;
+}
+
+int llmaxpayload_ctx(ll_ctx *c) {
+    return c->max_payload;
+}
+
+int llpayload_ctx(ll_ctx *c) {
+    return atomic_load_explicit(&c->payload_now, memory_order_relaxed);
+}
+
+// Header (FLAG A C [F] BCC1), then the trailer with every FCS byte escaped
+static int frame_overhead(ll_ctx *c) {
+    return 4 + (c->adaptive ? 1 : 0) + 2 * fcs_size(c->fcs) + 1;
+}
+
+// FEC check bytes for a payload of len bytes sent now
+static int fec_overhead(ll_ctx *c, int len) {
+    int fec = atomic_load_explicit(&c->fec_now, memory_order_relaxed);
+    return fec ? fec * fec_blocks(fec, 1 + len + fcs_size(c->fcs)) : 0;
+}
+
+int llframesize_ctx(ll_ctx *c, int bufSize) {
+    return frame_overhead(c) + fec_overhead(c, bufSize) + bufSize;
+}
+
+int llfit_ctx(ll_ctx *c, const unsigned char *buf, int bufSize, int frameSize) {
+    if (bufSize > c->max_payload) bufSize = c->max_payload;
+    // The scrambler key and the FEC check bytes may be escaped themselves;
+    // the check bytes are counted for no more data than could fit
+    int room = frameSize - frame_overhead(c) - (c->scramble ? 2 : 0);
+    room -= 2 * fec_overhead(c, bufSize < room ? bufSize : room);
+    if (room <= 0) return -1;
+    if (!c->scramble) return stuffFit(buf, bufSize, room);
+
+    // Drop the excess from the end until the best key for the whole takes
+    // no more than room. Its escapes only go down, and llsend_ctx() picks
+    // the best key for what is left, which does at least as well.
+    int n = bufSize < room ? bufSize : room;
+    int escapes, plain;
+    uint8_t key = scramble_key(buf, n, &escapes, &plain);
+    while (n + escapes > room) {
+        int drop = n + escapes - room;
+        for (int i = n - drop; i < n; ++i) {
+            uint8_t b = buf[i] ^ key;
+            if (b == FLAG || b == ESC) escapes--;
+        }
+        n -= drop;
+    }
+    return n;
 }
 
 ////////////////////////////////////////////////
 // LLWRITE
 ////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize) {
-    if (!buf || bufSize < 0 || bufSize > MAX_PAYLOAD_SIZE) return -1;
-
-    unsigned char frame[MAX_FRAME_SIZE];
-    int pos = 0;
-    unsigned char C = (g_tx_ns == 0) ? C_I_NS0 : C_I_NS1;
-    frame[pos++] = FLAG;
-    frame[pos++] = A_TX;
-    frame[pos++] = C;
-    frame[pos++] = bcc1(A_TX, C);
-
-    unsigned char payload_with_bcc[MAX_PAYLOAD_SIZE + 1];
-    memcpy(payload_with_bcc, buf, bufSize);
-    payload_with_bcc[bufSize] = bcc2(buf, bufSize);
-    int pwlen = bufSize + 1;
-
-    unsigned char stuffed[MAX_FRAME_SIZE];
-    int stuffed_len = stuff(payload_with_bcc, pwlen, stuffed, sizeof(stuffed));
-    if (stuffed_len < 0) return -1;
-    if (pos + stuffed_len >= (int)sizeof(frame) - 2) return -1;
-    memcpy(frame + pos, stuffed, stuffed_len);
-    pos += stuffed_len;
-
-    frame[pos++] = FLAG;
-
-    struct sigaction act = {0};
-    act.sa_handler = alarm_handler;
-    sigemptyset(&act.sa_mask);
-    if (sigaction(SIGALRM, &act, NULL) == -1) return -1;
-
-    int attempts = 0;
-
-    while (attempts < g_nretrans) {
-        alarm_fired = 0;
-        
-        printf("Sending frame (seq: %d, size: %d bytes)\n", g_tx_ns, bufSize);
-        
-        if (writeBytesSerialPort(frame, pos) != pos) return -1;
-        alarm(g_timeout);
-
-        unsigned char rc = 0;
-        int r = read_su(A_RX, &rc);
-        if (r == 0) {
-            if (rc == C_RR0 || rc == C_RR1) {
-                unsigned char nr = (rc == C_RR1) ? 1 : 0;
-                if (nr == (uint8_t)(g_tx_ns ^ 1)) {
-                    alarm(0);
-                    alarm_fired = 0;
-                    g_tx_ns ^= 1;
-                    return bufSize;
-                } else {
-                    continue;
-                }
-            } else if (rc == C_REJ0 || rc == C_REJ1) {
-                alarm(0);
-                alarm_fired = 0;
-                attempts++;
-                printf("REJ received (attempt %d/%d)\n", attempts, g_nretrans);
-                continue;
-            } else if (rc == C_DISC) {
-                alarm(0);
-                alarm_fired = 0;
-                return -1;
-            } else {
-                continue;
-            }
-        } else {
-            if (alarm_fired) {
-                alarm(0);
-                alarm_fired = 0;
-                attempts++;
-                printf("Timeout (attempt %d/%d)\n", attempts, g_nretrans);
-                continue;
-            }
-            attempts++;
-            continue;
+// Queue and send one frame, only blocking while the window is full
+static int send_packet(ll_ctx *c, const unsigned char *buf, int bufSize) {
+    if (!c || !buf || bufSize < 0 || bufSize > c->max_payload) return -1;
+
+    while (c->tx_next - c->tx_base >= (uint32_t)c->window) {
+        if (wait_ack(c) < 0) {
+            timer_stop(c);
+            return -1;
+        }
+    }
+
+    uint32_t seq = c->tx_next;
+    TxSlot *s = &c->tx[seq % c->window];
+    if (c->adaptive) memcpy(s->data, buf, bufSize);
+    if (encode_iframe(c, seq, buf, bufSize, atomic_load_explicit(&c->fec_now, memory_order_relaxed)) < 0)
+        return -1;
+    s->size = bufSize;
+    s->sends = 0;
+    s->attempts = 1;
+    c->tx_next++;
+
+    if (send_iframe(c, seq) < 0) return -1;
+    c->stats.bytesSent += bufSize;
+    return bufSize;
+}
+
+int llsend_ctx(ll_ctx *c, const unsigned char *buf, int bufSize) {
+    int64_t start = now_us();
+    if (send_packet(c, buf, bufSize) < 0) return -1;
+    histRecord(&c->stats.writeTime, now_us() - start);
+    return bufSize;
+}
+
+int llunacked_ctx(ll_ctx *c) {
+    if (!c) return -1;
+    while (c->tx_base != c->tx_next && pending_event(c, 1)) {
+        if (wait_ack(c) < 0) {
+            timer_stop(c);
+            return -1;
         }
     }
+    return (int)(c->tx_next - c->tx_base);
+}
+
+int llwindow_ctx(ll_ctx *c) {
+    int unacked = llunacked_ctx(c);
+    return unacked < 0 ? -1 : c->window - unacked;
+}
 
-    alarm(0); alarm_fired = 0;
-    return -1;
+int llwrite_ctx(ll_ctx *c, const unsigned char *buf, int bufSize) {
+    int64_t start = now_us();
+    if (send_packet(c, buf, bufSize) < 0) return -1;
+
+    // Only block while the window is full; with a window of 1 this waits
+    // for the RR of the frame just sent (stop-and-wait).
+    while (c->tx_next - c->tx_base >= (uint32_t)c->window) {
+        if (wait_ack(c) < 0) {
+            timer_stop(c);
+            return -1;
+        }
+    }
+    histRecord(&c->stats.writeTime, now_us() - start);
+    return bufSize;
 }
 
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
-int llread(unsigned char *packet) {
-    if (!packet) return -1;
+// Deliver the next packet in order. Without block, return 0 as soon as no
+// more bytes are waiting on the port instead of blocking for them.
+static int read_packet(ll_ctx *c, unsigned char *packet, int block) {
     int rejCount = 0;
     while (1) {
+        RxSlot *next = &c->rx[c->rx_deliver % c->window];
+        if (next->ready) {
+            int n = next->len;
+            if (n > 0) memcpy(packet, next->data, n);
+            next->ready = 0;
+            next->rejected = 0;
+            TRACE(TRACE_FRAMES, c->trace, TrDeliver, c->rx_deliver, n);
+            c->rx_deliver++;
+            return n;
+        }
+
         unsigned char C = 0;
-        unsigned char local[MAX_PAYLOAD_SIZE + 16];
-        int n = read_iframe(A_TX, &C, local, MAX_PAYLOAD_SIZE);
+        const unsigned char *data;
+        int n = read_frame(c, c->peer_addr, &C, &data, block);
+        if (n == READ_AGAIN) return 0;
+        if (n < 0 && c->timer_fired) {
+            // Frames of our own are waiting for an acknowledgement
+            if (handle_timeout(c) < 0) return -1;
+            continue;
+        }
         if (n < 0) {
-            unsigned char rej = (g_rx_expected == 0) ? C_REJ0 : C_REJ1;
-            send_su(A_RX, rej);
-            printf("REJ sent (expected seq: %d)\n", g_rx_expected);
+            // Stop-and-wait rejects every bad frame; with a window, a frame
+            // is rejected once and further losses are left to the timeout,
+            // so noise on other frames does not burn its retransmissions.
+            RxSlot *missing = &c->rx[c->rx_expected % c->window];
+            if (c->rx_expected - c->rx_deliver < (uint32_t)c->window &&
+                (c->window == 1 || !missing->rejected)) {
+                missing->rejected = 1;
+                send_su(c, c->addr, ctrl(c, C_REJ, c->rx_expected));
+                printf("REJ sent (expected seq: %u)\n", (unsigned)(c->rx_expected % c->seq_mod));
+                c->stats.rejSent++;
+                TRACE(TRACE_EVENTS, c->trace, TrRejSent, c->rx_expected, 0);
+            }
             rejCount++;
             if (rejCount > 10) {
                 fprintf(stderr, "Too many REJ sent, aborting connection...\n");
@@ -397,72 +1448,189 @@ int llread(unsigned char *packet) {
             }
             continue;
         }
-        rejCount = 0;
-
-        unsigned char ns = (C & 0x80) ? 1 : 0;
 
-        if (ns == g_rx_expected) {
-            unsigned char rr = (g_rx_expected ^ 1) ? C_RR1 : C_RR0;
-            if (send_su(A_RX, rr) < 0) return -1;
-            g_rx_expected ^= 1;
-            if (n > 0) memcpy(packet, local, n);
-            printf("Frame accepted (seq: %d, size: %d bytes)\n", ns, n);
-            return n;
-        } else {
-            printf("Duplicated Frame Detected!\nReceived seq:%d but Expected seq:%d...\n", ns, g_rx_expected);
-            printf("Discarding duplicate and resending RR%d.\n", g_rx_expected);
-            
-            unsigned char rr = (g_rx_expected) ? C_RR1 : C_RR0;
-            if (send_su(A_RX, rr) < 0) return -1;
+        if (C == C_SET) {
+            // Our UA was lost, the transmitter is still in llopen()
+            if (writeBytesSerialPort(&c->port, c->ua, c->ua_len) != c->ua_len) return -1;
+            continue;
+        }
+        if (ctrl_type(c, C) == C_RR || ctrl_type(c, C) == C_REJ) {
+            // Acknowledgement for frames sent the other way
+            if (handle_ack(c, C, data, n) < 0) return -1;
             continue;
         }
+        if (ctrl_type(c, C) != C_I) continue;
+        rejCount = 0;
+
+        if (receive_iframe(c, C, data, n) < 0) return -1;
     }
 }
 
+int llread_ctx(ll_ctx *c, unsigned char *packet) {
+    if (!c || !packet) return -1;
+    return read_packet(c, packet, 1);
+}
+
+int lltryread_ctx(ll_ctx *c, unsigned char *packet) {
+    if (!c || !packet) return -1;
+    return read_packet(c, packet, 0);
+}
+
+////////////////////////////////////////////////
+// STATISTICS
+////////////////////////////////////////////////
+int llstats_ctx(ll_ctx *c, LinkLayerStats *stats) {
+    if (!c || !stats) return -1;
+    *stats = c->stats;
+    unsigned long calls, bytes;
+    getSerialPortStats(&c->port, &calls, &bytes);
+    stats->elapsed = (now_us() - c->opened_at) / 1e6;
+    stats->wireBytesReceived = bytes;
+    stats->stuffingRatio = c->stuff_in ? (double)c->stuff_out / c->stuff_in : 1.0;
+    stats->fecBytes = c->fec_bytes;
+    stats->fecFrames = c->fec_frames;
+    stats->fecFailed = c->fec_failed;
+    return 0;
+}
+
+// Write the string s as a JSON string
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char)*s >= 0x20) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void json_histogram(FILE *f, const char *name, const Histogram *h) {
+    fprintf(f, ",\"%s\":{\"count\":%llu,\"min\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+               "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+            name, (unsigned long long)h->count, (unsigned long long)h->min, histMean(h),
+            (unsigned long long)histQuantile(h, 0.5), (unsigned long long)histQuantile(h, 0.9),
+            (unsigned long long)histQuantile(h, 0.99), (unsigned long long)histQuantile(h, 0.999),
+            (unsigned long long)h->max);
+}
+
+// Write the statistics as one JSON object on a line of its own
+static void json_stats(FILE *f, ll_ctx *c, const LinkLayerStats *s) {
+    fprintf(f, "{\"port\":");
+    json_string(f, c->port_name);
+    fprintf(f, ",\"role\":\"%s\",\"elapsed_s\":%.3f", c->role == LlTx ? "tx" : "rx", s->elapsed);
+    fprintf(f, ",\"frames_sent\":%lu,\"frames_received\":%lu,\"bytes_sent\":%llu,\"bytes_received\":%llu"
+               ",\"wire_bytes_sent\":%llu,\"wire_bytes_received\":%llu",
+            s->framesSent, s->framesReceived, s->bytesSent, s->bytesReceived,
+            s->wireBytesSent, s->wireBytesReceived);
+    fprintf(f, ",\"retransmissions\":%lu,\"rej_sent\":%lu,\"rej_received\":%lu,\"timeouts\":%lu"
+               ",\"duplicates\":%lu,\"bad_frames\":%lu,\"stuffing_ratio\":%.4f",
+            s->retransmissions, s->rejSent, s->rejReceived, s->timeouts, s->duplicates, s->badFrames,
+            s->stuffingRatio);
+    fprintf(f, ",\"fec_bytes\":%lu,\"fec_frames\":%lu,\"fec_failed\":%lu",
+            s->fecBytes, s->fecFrames, s->fecFailed);
+    json_histogram(f, "rtt_us", &s->rtt);
+    json_histogram(f, "write_us", &s->writeTime);
+    fprintf(f, "}\n");
+}
+
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-int llclose() {
-    struct sigaction act = {0};
-    act.sa_handler = alarm_handler;
-    sigemptyset(&act.sa_mask);
-    if (sigaction(SIGALRM, &act, NULL) == -1) {
-        closeSerialPort();
-        return -1;
+// Report how many read() calls the receive path needed per frame
+static void print_read_stats(ll_ctx *c) {
+    unsigned long calls, bytes;
+    getSerialPortStats(&c->port, &calls, &bytes);
+    printf("Received %lu bytes in %lu frames using %lu read() calls (%.2f per frame)\n",
+           bytes, c->frames_read, calls, c->frames_read ? (double)calls / c->frames_read : 0.0);
+    if (c->fec)
+        printf("FEC: %lu bytes corrected in %lu frames, %lu frames beyond repair\n",
+               c->fec_bytes, c->fec_frames, c->fec_failed);
+}
+
+// Report the round-trip estimate the transmitter ended with
+static void print_rtt_stats(ll_ctx *c) {
+    printf("RTT: %lu samples, SRTT %.2f ms, RTTVAR %.2f ms, RTO %.2f ms\n",
+           c->rtt_samples, c->srtt / 1000.0, c->rttvar / 1000.0, c->rto / 1000.0);
+    if (c->scramble)
+        printf("Scrambler: %lu escapes sent, %lu avoided\n", c->escapes_sent, c->escapes_avoided);
+    if (c->adaptive)
+        printf("Hybrid ARQ: %lu changes, ended with frames of up to %d bytes and %d check bytes per codeword\n",
+               c->harq_changes, atomic_load(&c->payload_now), atomic_load(&c->fec_now));
+}
+
+// Print the statistics of a closed link, then write them as JSON to the
+// statistics file, or to the console without one
+static void report_stats(ll_ctx *c) {
+    LinkLayerStats s;
+    llstats_ctx(c, &s);
+    print_read_stats(c);
+    if (c->role == LlTx) print_rtt_stats(c);
+    printf("I-frames: %lu sent (%lu retransmissions, %lu timeouts, %lu REJ received), "
+           "%lu received (%lu duplicates, %lu REJ sent), %lu bad frames\n",
+           s.framesSent, s.retransmissions, s.timeouts, s.rejReceived,
+           s.framesReceived, s.duplicates, s.rejSent, s.badFrames);
+    printf("Payload: %llu bytes sent in %llu on the wire (stuffing x%.4f), %llu received in %.2f s\n",
+           s.bytesSent, s.wireBytesSent, s.stuffingRatio, s.bytesReceived, s.elapsed);
+    if (s.rtt.count)
+        printf("RTT: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", histQuantile(&s.rtt, 0.5) / 1000.0,
+               histQuantile(&s.rtt, 0.99) / 1000.0, s.rtt.max / 1000.0);
+    if (s.writeTime.count)
+        printf("llwrite(): %llu calls, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               (unsigned long long)s.writeTime.count, histQuantile(&s.writeTime, 0.5) / 1000.0,
+               histQuantile(&s.writeTime, 0.99) / 1000.0, s.writeTime.max / 1000.0);
+
+    FILE *f = stdout;
+    if (c->stats_file[0] && !(f = fopen(c->stats_file, "a"))) {
+        perror(c->stats_file);
+        f = stdout;
     }
+    json_stats(f, c, &s);
+    if (f != stdout) fclose(f);
+}
 
-    if (g_role == LlTx) {
+// Run the DISC / UA exchange and release the link
+static int close_session(ll_ctx *c) {
+    // Every I-frame still in the window must be acknowledged first
+    while (c->tx_base != c->tx_next) {
+        if (wait_ack(c) < 0) {
+            timer_stop(c);
+            fprintf(stderr, "Unacknowledged frames left in the window\n");
+            break;
+        }
+    }
+
+    if (c->role == LlTx) {
         unsigned char disc[5] = {FLAG, A_TX, C_DISC, bcc1(A_TX, C_DISC), FLAG};
         int attempts = 0;
         printf("Sending DISC...\n");
-        while (attempts < g_nretrans) {
-            alarm_fired = 0;
-            if (writeBytesSerialPort(disc, 5) != 5) { 
+        while (attempts < c->nretrans) {
+            c->timer_fired = 0;
+            if (writeBytesSerialPort(&c->port, disc, 5) != 5) { 
                 fprintf(stderr, "Failed to send DISC\n");
-                closeSerialPort(); 
+                close_link(c); 
                 return -1; 
             }
-            alarm(g_timeout);
+            timer_start(c, line_written(c, 5));
 
             unsigned char rc = 0;
-            int r = read_su(A_RX, &rc);
+            int r = read_su(c, A_RX, &rc);
             if (r == 0 && rc == C_DISC) {
+                timer_stop(c);
                 printf("DISC received.\n");
                 unsigned char ua[5] = {FLAG, A_RX, C_UA, bcc1(A_RX, C_UA), FLAG};
-                if (writeBytesSerialPort(ua, 5) != 5) { 
+                if (writeBytesSerialPort(&c->port, ua, 5) != 5) { 
                     fprintf(stderr, "Failed to send UA\n");
-                    closeSerialPort(); 
+                    close_link(c); 
                     return -1; 
                 }
                 printf("Sending UA...\n\n");
-                closeSerialPort();
+                close_link(c);
                 printf("Serial port closed.\n");
                 return 0;
             }
-            if (alarm_fired) {
+            if (c->timer_fired) {
                 attempts++;
-                alarm(0);
-                alarm_fired = 0;
+                timer_stop(c);
+                rto_backoff(c);
                 printf("Timeout waiting for DISC, retrying (%d)...\n", attempts);
                 continue;
             }
@@ -473,38 +1641,147 @@ int llclose() {
             }
         }
         fprintf(stderr, "Max DISC retries reached; closing anyway\n");
-        closeSerialPort();
+        close_link(c);
         printf("Serial port closed.\n");
         return -1;
     } else {
+        // The transmitter gives up on a frame after nRetransmissions
+        // timeouts: after that long without a frame it is gone
+        int64_t silence = (int64_t)(c->nretrans + 1) * c->timeout * 1000000;
+        timer_arm(c, silence);
         while (1) {
             unsigned char rc = 0;
-            int r = read_su(A_TX, &rc);
+            int r = read_su(c, c->peer_addr, &rc);
+            if (r < 0 && c->timer_fired) {
+                fprintf(stderr, "No DISC received; closing anyway\n");
+                close_link(c);
+                return -1;
+            }
             if (r < 0) continue;
+            timer_arm(c, silence);
             if (rc == C_DISC) {
+                timer_stop(c);
                 printf("DISC received.\n");
                 break;
             }
+            // The RR for the last frames was lost: acknowledge again
+            if (ctrl_type(c, rc) == C_I) send_rr(c, c->rx_expected);
         }
         unsigned char disc_rx[5] = {FLAG, A_RX, C_DISC, bcc1(A_RX, C_DISC), FLAG};
-        if (writeBytesSerialPort(disc_rx, 5) != 5) { 
-            fprintf(stderr, "Failed to send DISC\n");
-            closeSerialPort(); 
-            return -1; 
-        }
+        int attempts = 0;
+        int acked = 0;
         printf("Sending DISC...\n");
+        while (!acked && attempts < c->nretrans) {
+            if (writeBytesSerialPort(&c->port, disc_rx, 5) != 5) { 
+                fprintf(stderr, "Failed to send DISC\n");
+                close_link(c); 
+                return -1; 
+            }
+            timer_start(c, line_written(c, 5));
 
-        while (1) {
-            unsigned char rc = 0;
-            int r = read_su(A_RX, &rc);
-            if (r < 0) continue;
-            if (rc == C_UA) {
-                printf("UA received.\n\n");
-                break;
+            // Resend DISC if the UA does not arrive within the timeout
+            while (1) {
+                unsigned char rc = 0;
+                int r = read_su(c, A_RX, &rc);
+                if (r < 0 && c->timer_fired) {
+                    attempts++;
+                    rto_backoff(c);
+                    printf("Timeout waiting for UA, retrying (%d)...\n", attempts);
+                    break;
+                }
+                if (r == 0 && rc == C_UA) {
+                    timer_stop(c);
+                    printf("UA received.\n\n");
+                    acked = 1;
+                    break;
+                }
             }
         }
-        closeSerialPort();
+        if (!acked) fprintf(stderr, "No UA received; closing anyway\n");
+        close_link(c);
         printf("Serial port closed.\n");
         return 0;
     }
-}
\ No newline at end of file
+}
+
+int llclose_ctx(ll_ctx *c) {
+    if (!c) return -1;
+    int r = close_session(c);
+    report_stats(c);
+    TRACE(TRACE_EVENTS, c->trace, TrClose, r == 0, 0);
+    if (c->trace) {
+        char label[56];
+        snprintf(label, sizeof(label), "%s %s", c->port_name, c->role == LlTx ? "tx" : "rx");
+        if (traceWrite(c->trace, c->trace_file, label) < 0) perror(c->trace_file);
+        free(c->trace);
+    }
+    free(c);
+    return r;
+}
+
+////////////////////////////////////////////////
+// Multiple links
+////////////////////////////////////////////////
+ll_ctx *llopen_ctx(LinkLayer connectionParameters) {
+    ll_ctx *c = calloc(1, sizeof(ll_ctx));
+    if (!c) return NULL;
+    if (TRACE_LEVEL > TRACE_OFF && connectionParameters.traceFile[0])
+        c->trace = calloc(1, sizeof(TraceRing));
+    if (open_link(c, connectionParameters) < 0) {
+        free(c->trace);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+int llwait_ctx(ll_ctx **links, int n, int timeoutMs) {
+    struct pollfd fds[n > 0 ? 2 * n : 1];
+    for (int i = 0; i < n; ++i) {
+        ll_ctx *c = links[i];
+        if (c->rx[c->rx_deliver % c->window].ready || bufferedSerialPort(&c->port) > 0) return i;
+        fds[2 * i].fd = getSerialPortFd(&c->port);
+        fds[2 * i + 1].fd = c->timerfd;
+        fds[2 * i].events = fds[2 * i + 1].events = POLLIN;
+        fds[2 * i].revents = fds[2 * i + 1].revents = 0;
+    }
+    while (1) {
+        int r = poll(fds, 2 * n, timeoutMs);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) return n;
+        for (int i = 0; i < n; ++i)
+            if (fds[2 * i].revents || fds[2 * i + 1].revents) return i;
+    }
+}
+
+////////////////////////////////////////////////
+// Single link
+////////////////////////////////////////////////
+int llopen(LinkLayer connectionParameters) {
+    if (default_link) return -1;
+    default_link = llopen_ctx(connectionParameters);
+    return default_link ? 0 : -1;
+}
+
+int llwrite(const unsigned char *buf, int bufSize) {
+    return llwrite_ctx(default_link, buf, bufSize);
+}
+
+int llread(unsigned char *packet) {
+    return llread_ctx(default_link, packet);
+}
+
+int llmaxpayload() {
+    return default_link ? llmaxpayload_ctx(default_link) : MAX_PAYLOAD_SIZE;
+}
+
+int llstats(LinkLayerStats *stats) {
+    return llstats_ctx(default_link, stats);
+}
+
+int llclose() {
+    int r = llclose_ctx(default_link);
+    default_link = NULL;
+    return r;
+}
@@ -1,15 +1,26 @@
 // Link layer header.
-// DO NOT CHANGE THIS FILE
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
 
+#include "histogram.h"
+
 typedef enum
 {
     LlTx,
     LlRx,
 } LinkLayerRole;
 
+// Frame check sequence protecting the information field of I-frames.
+// The transmitter proposes one in SET; peers without it use the XOR BCC2.
+typedef enum
+{
+    LlFcsXor,
+    LlFcsCrc16,
+    LlFcsCrc32,
+    LlFcsCrc32c,
+} LinkLayerFcs;
+
 typedef struct
 {
     char serialPort[50];
@@ -17,12 +28,55 @@ typedef struct
     int baudRate;
     int nRetransmissions;
     int timeout;
+    int windowSize;
+    LinkLayerFcs fcs;
+    int maxPayloadSize;
+    int scramble; // 1 to propose the escape-minimizing scrambler
+    int fec;      // Reed-Solomon check bytes per codeword to propose (even, 0 = none)
+    int adaptive; // 1 to propose hybrid ARQ: fec is then the most the transmitter uses
+    char statsFile[256]; // File llclose() appends the statistics to as a JSON line ("" = console)
+    char traceFile[256]; // File llclose() appends the trace of the link to (trace.h; "" = no trace)
 } LinkLayer;
 
+// Statistics of one link since llopen()
+typedef struct
+{
+    double elapsed;                       // Seconds since the link was opened
+    unsigned long framesSent;             // I-frames, every copy
+    unsigned long framesReceived;         // I-frames accepted, duplicates left out
+    unsigned long long bytesSent;         // Payload given to llwrite()
+    unsigned long long bytesReceived;     // Payload of the I-frames accepted
+    unsigned long long wireBytesSent;     // I-frames on the wire, every copy
+    unsigned long long wireBytesReceived; // Everything read from the port
+    unsigned long retransmissions;
+    unsigned long rejSent;
+    unsigned long rejReceived;
+    unsigned long timeouts;
+    unsigned long duplicates;
+    unsigned long badFrames;              // Dropped for a bad BCC / FCS or size
+    double stuffingRatio;                 // I-frame bodies on the wire / before stuffing
+    unsigned long fecBytes;               // Bytes Reed-Solomon corrected
+    unsigned long fecFrames;              // Frames that needed it
+    unsigned long fecFailed;              // Frames beyond repair
+    Histogram rtt;                        // Round trip of I-frames sent once (us)
+    Histogram writeTime;                  // Time spent in each llwrite() / llsend_ctx() (us)
+} LinkLayerStats;
+
 // Size of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer.
+// This is the default; a larger maxPayloadSize can be negotiated in llopen()
+// and read back with llmaxpayload().
 #define MAX_PAYLOAD_SIZE 1000
 
+// Bounds for the negotiated maximum payload
+#define LL_MIN_PAYLOAD_SIZE 512
+#define LL_MAX_PAYLOAD_LIMIT 65536
+
+// Largest sliding window (number of unacknowledged I-frames in flight).
+// A window of 1 is plain stop-and-wait; larger windows switch to 4-bit
+// sequence numbers with cumulative RR and selective REJ.
+#define LL_MAX_WINDOW 8
+
 // MISC
 #define FALSE 0
 #define TRUE 1
@@ -39,8 +93,72 @@ int llwrite(const unsigned char *buf, int bufSize);
 // Return number of chars read, or -1 on error.
 int llread(unsigned char *packet);
 
+// Maximum payload agreed in llopen(): llwrite() accepts and llread() may
+// return up to this many bytes.
+int llmaxpayload();
+
 // Close previously opened connection and print transmission statistics in the console.
 // Return 0 on success or -1 on error.
 int llclose();
 
+// Statistics of the link opened by llopen() so far.
+// Return 0 on success or -1 on error.
+int llstats(LinkLayerStats *stats);
+
+// Handle-based API: every link keeps its own state, so one process can
+// drive several links at once. The functions above work on a single
+// implicit link opened by llopen().
+typedef struct ll_ctx ll_ctx;
+
+// Open a link. Return its handle or NULL on error.
+ll_ctx *llopen_ctx(LinkLayer connectionParameters);
+
+// llwrite(), llread() and llmaxpayload() on the given link.
+int llwrite_ctx(ll_ctx *ctx, const unsigned char *buf, int bufSize);
+int llread_ctx(ll_ctx *ctx, unsigned char *packet);
+int llmaxpayload_ctx(ll_ctx *ctx);
+
+// Payload per frame the link asks for now: the maximum payload, or less
+// while hybrid ARQ keeps frames short on a noisy line. Any thread may call it.
+int llpayload_ctx(ll_ctx *ctx);
+
+// Bytes on the wire for a frame of bufSize bytes that need no stuffing,
+// counting the frame check sequence as if it were fully escaped.
+int llframesize_ctx(ll_ctx *ctx, int bufSize);
+
+// How many leading bytes of buf (at most bufSize and the maximum payload)
+// go out in a frame of no more than frameSize bytes on the wire once
+// stuffed, or -1 if not even an empty frame fits. Only reads settings fixed
+// in llopen() and the current hybrid ARQ settings, so any thread may call it.
+int llfit_ctx(ll_ctx *ctx, const unsigned char *buf, int bufSize, int frameSize);
+
+// Like llwrite_ctx(), but return as soon as the frame is sent: only block
+// while the window is full. llclose_ctx() waits for what is still unacknowledged.
+int llsend_ctx(ll_ctx *ctx, const unsigned char *buf, int bufSize);
+
+// Handle the acknowledgements and timeouts already pending, without blocking.
+// Return the free window slots (frames llsend_ctx() sends without blocking)
+// or -1 if the link failed.
+int llwindow_ctx(ll_ctx *ctx);
+
+// Same as llwindow_ctx(), but return the frames still unacknowledged.
+int llunacked_ctx(ll_ctx *ctx);
+
+// Like llread_ctx(), but return 0 instead of blocking when no packet is
+// complete yet.
+int lltryread_ctx(ll_ctx *ctx, unsigned char *packet);
+
+// llstats() on the given link. Only call it from the thread driving the link.
+int llstats_ctx(ll_ctx *ctx, LinkLayerStats *stats);
+
+// Close the link, print its statistics and release its handle.
+// Return 0 on success or -1 on error.
+int llclose_ctx(ll_ctx *ctx);
+
+// Wait up to timeoutMs (-1 waits forever) until one of the n links has a
+// packet ready, received bytes or an expired retransmission timer, so a
+// single loop can serve many links with lltryread_ctx() / llwindow_ctx().
+// Return the index of that link, n on timeout or -1 on error.
+int llwait_ctx(ll_ctx **links, int n, int timeoutMs);
+
 #endif // _LINK_LAYER_H_
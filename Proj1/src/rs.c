@@ -0,0 +1,154 @@
+// Reed-Solomon implementation.
+// GF(256) products go through log / antilog tables, and so does the
+// encoder LFSR, with the generator polynomial kept as logs. Decoding
+// computes the syndromes (Horner, with a product table per root), stops
+// there when they are all zero, and otherwise finds the error locator
+// (Berlekamp-Massey), its roots (Chien search) and the error values
+// (Forney).
+
+#include "rs.h"
+
+#include <string.h>
+
+#define GF_POLY 0x11D
+
+static unsigned char gfExp[512]; // Doubled so a sum of two logs needs no modulo
+static unsigned char gfLog[256];
+
+// Generator polynomial for each parity count, highest power first (the
+// leading 1 left out), as logs
+static unsigned char genLog[RS_MAX_PARITY + 1][RS_MAX_PARITY];
+
+// Products by a^j for every root a^j, for the syndromes
+static unsigned char mulRoot[RS_MAX_PARITY][256];
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) return 0;
+    return gfExp[gfLog[a] + gfLog[b]];
+}
+
+static unsigned char gf_div(unsigned char a, unsigned char b) {
+    if (a == 0) return 0;
+    return gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+__attribute__((constructor))
+static void rs_init() {
+    int x = 1;
+    for (int i = 0; i < 255; ++i) {
+        gfExp[i] = gfExp[i + 255] = (unsigned char)x;
+        gfLog[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+    gfExp[510] = gfExp[0];
+    for (int j = 0; j < RS_MAX_PARITY; ++j) {
+        for (int v = 0; v < 256; ++v) mulRoot[j][v] = gf_mul((unsigned char)v, gfExp[j]);
+    }
+
+    // g(x) = (x - a^0)(x - a^1)...(x - a^(n-1)), lowest power first here
+    for (int n = 1; n <= RS_MAX_PARITY; ++n) {
+        unsigned char g[RS_MAX_PARITY + 1] = {1};
+        for (int i = 0; i < n; ++i) {
+            for (int j = i + 1; j > 0; --j) g[j] = g[j - 1] ^ gf_mul(g[j], gfExp[i]);
+            g[0] = gf_mul(g[0], gfExp[i]);
+        }
+        // g[n] is the leading 1; the LFSR wants g[n-1] .. g[0]
+        for (int j = 0; j < n; ++j) genLog[n][j] = g[n - 1 - j] ? gfLog[g[n - 1 - j]] : 255;
+    }
+}
+
+void rsEncode(const unsigned char *data, int len, unsigned char *parity, int nparity) {
+    const unsigned char *g = genLog[nparity];
+    memset(parity, 0, nparity);
+    for (int i = 0; i < len; ++i) {
+        unsigned char fb = data[i] ^ parity[0];
+        memmove(parity, parity + 1, nparity - 1);
+        parity[nparity - 1] = 0;
+        if (fb == 0) continue;
+        int lf = gfLog[fb];
+        for (int j = 0; j < nparity; ++j) {
+            if (g[j] != 255) parity[j] ^= gfExp[lf + g[j]];
+        }
+    }
+}
+
+int rsDecode(unsigned char *data, int len, unsigned char *parity, int nparity) {
+    int n = len + nparity;
+
+    // S_j = c(a^j), the first byte being the highest power
+    unsigned char s[RS_MAX_PARITY];
+    int errors = 0;
+    for (int j = 0; j < nparity; ++j) {
+        const unsigned char *mul = mulRoot[j];
+        unsigned char acc = 0;
+        for (int i = 0; i < len; ++i) acc = mul[acc] ^ data[i];
+        for (int i = 0; i < nparity; ++i) acc = mul[acc] ^ parity[i];
+        s[j] = acc;
+        errors |= acc;
+    }
+    if (!errors) return 0;
+
+    // Berlekamp-Massey: error locator lambda, lowest power first
+    unsigned char lambda[RS_MAX_PARITY + 1] = {1};
+    unsigned char prev[RS_MAX_PARITY + 1] = {1};
+    int L = 0, m = 1;
+    unsigned char b = 1;
+    for (int r = 0; r < nparity; ++r) {
+        unsigned char d = s[r];
+        for (int i = 1; i <= L; ++i) d ^= gf_mul(lambda[i], s[r - i]);
+        if (d == 0) {
+            m++;
+            continue;
+        }
+        unsigned char coef = gf_div(d, b);
+        unsigned char t[RS_MAX_PARITY + 1];
+        memcpy(t, lambda, sizeof(t));
+        for (int i = 0; i + m <= nparity; ++i) lambda[i + m] ^= gf_mul(coef, prev[i]);
+        if (2 * L <= r) {
+            L = r + 1 - L;
+            memcpy(prev, t, sizeof(prev));
+            b = d;
+            m = 1;
+        } else {
+            m++;
+        }
+    }
+    if (2 * L > nparity) return -1;
+
+    // Omega = S * lambda mod x^nparity
+    unsigned char omega[RS_MAX_PARITY];
+    for (int i = 0; i < nparity; ++i) {
+        unsigned char acc = 0;
+        for (int j = 0; j <= i && j <= L; ++j) acc ^= gf_mul(lambda[j], s[i - j]);
+        omega[i] = acc;
+    }
+
+    // Chien search over the positions of this (shortened) codeword; byte i
+    // stands for X = a^(n-1-i), a root of lambda at X^-1 marks an error
+    int found = 0;
+    for (int i = 0; i < n && found < L; ++i) {
+        int p = n - 1 - i;
+        int inv = (255 - p) % 255;
+        unsigned char v = 0;
+        for (int j = 0; j <= L; ++j) {
+            if (lambda[j]) v ^= gfExp[gfLog[lambda[j]] + (inv * j) % 255];
+        }
+        if (v != 0) continue;
+
+        // Forney: e = X * omega(X^-1) / lambda'(X^-1)
+        unsigned char num = 0, den = 0;
+        for (int j = 0; j < nparity; ++j) {
+            if (omega[j]) num ^= gfExp[gfLog[omega[j]] + (inv * j) % 255];
+        }
+        for (int j = 1; j <= L; j += 2) {
+            if (lambda[j]) den ^= gfExp[gfLog[lambda[j]] + (inv * (j - 1)) % 255];
+        }
+        if (den == 0) return -1;
+        unsigned char e = gf_mul(gf_div(num, den), gfExp[p]);
+        if (i < len) data[i] ^= e;
+        else parity[i - len] ^= e;
+        found++;
+    }
+    return found == L ? L : -1;
+}
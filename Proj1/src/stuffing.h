@@ -0,0 +1,33 @@
+// Byte stuffing header.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#include <stdint.h>
+
+#define FLAG 0x7E
+#define ESC 0x7D
+#define ESC_XOR 0x20
+
+// Stuff inlen bytes from in into out (FLAG and ESC become ESC, byte ^ ESC_XOR).
+// When bcc is not NULL, every input byte is also XOR-folded into *bcc.
+// Returns the stuffed length or -1 if it does not fit in outcap.
+int stuffBytes(const unsigned char *in, int inlen, unsigned char *out, int outcap, uint8_t *bcc);
+
+// Undo stuffBytes().
+// Returns the destuffed length or -1 on a dangling ESC or if it does not fit in outcap.
+int destuffBytes(const unsigned char *in, int inlen, unsigned char *out, int outcap);
+
+// Length of the longest prefix of in (at most inlen bytes) that
+// stuffBytes() turns into no more than outcap bytes.
+int stuffFit(const unsigned char *in, int inlen, int outcap);
+
+// Name of the kernel in use: "avx2", "sse2" or "scalar". The fastest one the
+// CPU supports is picked at startup.
+const char *stuffingKernel();
+
+// Force a kernel by name (for benchmarks, before any other thread stuffs).
+// Returns 0 on success or -1 if the CPU does not support it.
+int setStuffingKernel(const char *name);
+
+#endif // _STUFFING_H_
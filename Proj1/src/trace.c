@@ -0,0 +1,49 @@
+// Trace implementation.
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+void traceRecord(TraceRing *r, int type, uint32_t a, uint32_t b) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t i = atomic_fetch_add_explicit(&r->next, 1, memory_order_relaxed);
+    TraceEvent *e = &r->events[i % TRACE_RING_SIZE];
+    e->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    e->a = a;
+    e->b = b;
+    e->type = (uint16_t)type;
+}
+
+int traceWrite(TraceRing *r, const char *path, const char *label) {
+    TraceFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    snprintf(h.label, sizeof(h.label), "%s", label);
+    h.recorded = atomic_load(&r->next);
+    h.events = h.recorded < TRACE_RING_SIZE ? (uint32_t)h.recorded : TRACE_RING_SIZE;
+    h.eventSize = sizeof(TraceEvent);
+
+    // Oldest first: from the oldest event kept to the end of the ring, then
+    // from its start. One writev() on an O_APPEND file keeps the record
+    // whole when other links append theirs at the same time.
+    uint32_t start = (h.recorded - h.events) % TRACE_RING_SIZE;
+    uint32_t tail = h.events < TRACE_RING_SIZE - start ? h.events : TRACE_RING_SIZE - start;
+    struct iovec iov[3] = {
+        { &h, sizeof(h) },
+        { r->events + start, tail * sizeof(TraceEvent) },
+        { r->events, (h.events - tail) * sizeof(TraceEvent) },
+    };
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) return -1;
+    ssize_t w = writev(fd, iov, 3);
+    if (close(fd) != 0) return -1;
+    return w == (ssize_t)total ? 0 : -1;
+}
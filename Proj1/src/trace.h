@@ -0,0 +1,92 @@
+// Trace header.
+// Binary events with a timestamp, kept in a ring in memory so a link can
+// record every frame without printing it: recording one is a clock read
+// and a few stores, and trace points above TRACE_LEVEL compile to nothing.
+// The newest TRACE_RING_SIZE events are written to a file with
+// traceWrite() and printed with tools/trace_decode.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Trace levels: build with -DTRACE_LEVEL=TRACE_OFF (0) to compile every
+// trace point out, or TRACE_EVENTS (1) to keep only the rare ones
+#define TRACE_OFF 0
+#define TRACE_EVENTS 1 // Opening and closing, losses and recoveries
+#define TRACE_FRAMES 2 // Also every frame sent, accepted, delivered and acknowledged
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_FRAMES
+#endif
+
+// Events kept: the newest overwrite the oldest (a power of two)
+#define TRACE_RING_SIZE 16384
+
+// What happened, and what a and b hold
+typedef enum
+{
+    TrOpen = 1,    // Link opened. a: window, b: maximum payload
+    TrClose,       // Link closed. a: 1 if cleanly
+    TrSend,        // I-frame sent. a: sequence, b: payload bytes
+    TrResend,      // I-frame sent again. a: sequence, b: payload bytes
+    TrAccept,      // I-frame stored. a: sequence, b: payload bytes
+    TrDeliver,     // Packet returned by llread(). a: sequence, b: bytes
+    TrDuplicate,   // I-frame received again. a: sequence expected
+    TrBadFrame,    // Frame dropped for its BCC / FCS or size. b: bytes
+    TrRrSent,      // a: sequence acknowledged up to
+    TrRejSent,     // a: sequence asked for
+    TrRrReceived,  // a: sequence acknowledged up to, b: bytes FEC corrected
+    TrRejReceived, // a: sequence asked for
+    TrTimeout,     // a: oldest sequence unacknowledged, b: RTO (us)
+    TrHarq,        // Hybrid ARQ changed settings. a: check bytes, b: payload
+    TrEventTypes
+} TraceEventType;
+
+typedef struct
+{
+    uint64_t time; // CLOCK_MONOTONIC, in ns
+    uint32_t a;
+    uint32_t b;
+    uint16_t type;
+} TraceEvent;
+
+// Events are claimed with an atomic increment, so any thread may record
+// into a ring. A ring written out while events are still being recorded
+// may hold one half-written event.
+typedef struct
+{
+    _Atomic uint64_t next; // Events recorded so far
+    TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+// Each traceWrite() appends a record to the file: this header, then its
+// events from the oldest, in the byte order of the machine
+#define TRACE_MAGIC "LLTRACE1"
+
+typedef struct
+{
+    char magic[8];
+    char label[56];    // Which link, e.g. its port and role
+    uint64_t recorded; // Events recorded; those beyond the events that follow were overwritten
+    uint32_t events;
+    uint32_t eventSize; // sizeof(TraceEvent)
+} TraceFileHeader;
+
+// Record an event into ring r (when r is not NULL) if level is traced
+#define TRACE(level, r, type, a, b)                       \
+    do                                                    \
+    {                                                     \
+        if (TRACE_LEVEL >= (level) && (r))                \
+            traceRecord((r), (type), (a), (b));           \
+    } while (0)
+
+// Record an event, overwriting the oldest one once the ring is full.
+void traceRecord(TraceRing *r, int type, uint32_t a, uint32_t b);
+
+// Append the events in r to the file at path, under label.
+// Returns 0 on success or -1 on error.
+int traceWrite(TraceRing *r, const char *path, const char *label);
+
+#endif // _TRACE_H_
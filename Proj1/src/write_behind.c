@@ -0,0 +1,226 @@
+// Write-behind file output.
+// The receiving thread fills one buffer at a time and hands it over
+// through an SPSC queue; the flush thread pwrite()s it and hands it back
+// through another. With O_DIRECT a buffer must start, end and sit in memory
+// on WB_ALIGN boundaries: sequential data always does, except for the
+// tail, which is padded and trimmed again on close. The first unaligned
+// buffer (out of order or delta data) turns O_DIRECT off for the rest.
+// The flush thread makes the data durable itself: when a mark asks for
+// it, it runs fdatasync() once the buffers queued before the mark are
+// written and publishes how many buffers that covers, so the receiving
+// thread learns what is on disk without waiting for it. A blocking sync instead
+// takes every buffer back, which proves all of them written, and keeps
+// them as spares until they are filled again.
+
+#define _GNU_SOURCE
+#include "write_behind.h"
+#include "spsc_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct {
+    unsigned char *data; // WB_BUFFER_SIZE bytes, WB_ALIGN aligned
+    int len;
+    uint64_t offset;
+    int last;            // Ends at the end of the file: may be padded
+    uint64_t seq;        // Buffers queued before it and itself
+} WbBuffer;
+
+struct WriteBehind {
+    int fd;
+    _Atomic int direct;     // O_DIRECT still set (cleared by the flush thread)
+    pthread_t thread;
+    SpscQueue freeBuffers;  // Flush thread -> receiving thread
+    SpscQueue fullBuffers;  // Receiving thread -> flush thread
+    WbBuffer buffers[WB_BUFFERS];
+    WbBuffer *current;      // Being filled, NULL if none
+    WbBuffer *spare[WB_BUFFERS]; // Taken back by a sync, used before the queue
+    int nSpare;
+    uint64_t end;           // End of the data written so far
+    uint64_t queued;        // Buffers handed to the flush thread so far
+    _Atomic uint64_t wanted; // Buffers a mark asked to have on disk
+    _Atomic uint64_t synced; // Buffers known to be on disk (flush thread)
+    _Atomic int failed;
+    unsigned long writes;   // pwrite() calls (flush thread only)
+};
+
+static int write_all(int fd, const unsigned char *data, int len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int flush_buffer(WriteBehind *wb, WbBuffer *b) {
+    int len = b->len;
+    if (wb->direct) {
+        int tail = len % WB_ALIGN;
+        if (b->offset % WB_ALIGN == 0 && tail != 0 && b->last) {
+            memset(b->data + len, 0, WB_ALIGN - tail);
+            len += WB_ALIGN - tail;
+        } else if (b->offset % WB_ALIGN != 0 || tail != 0) {
+            fcntl(wb->fd, F_SETFL, fcntl(wb->fd, F_GETFL) & ~O_DIRECT);
+            wb->direct = 0;
+        }
+    }
+    wb->writes++;
+    return write_all(wb->fd, b->data, len, b->offset);
+}
+
+static void *flush_thread(void *arg) {
+    WriteBehind *wb = arg;
+    WbBuffer *b;
+    while ((b = spscPop(&wb->fullBuffers))) {
+        if (!atomic_load(&wb->failed) && flush_buffer(wb, b) < 0) {
+            perror("Error writing file");
+            atomic_store(&wb->failed, 1);
+        }
+        // Sync for a mark once its buffers are written, or earlier when
+        // caught up. A mark set after its last buffer was already written
+        // is served after the next one.
+        uint64_t seq = b->seq, wanted = atomic_load(&wb->wanted);
+        int due = wanted > atomic_load(&wb->synced) && (seq >= wanted || spscEmpty(&wb->fullBuffers));
+        if (!atomic_load(&wb->failed) && due) {
+            if (fdatasync(wb->fd) == 0) {
+                atomic_store(&wb->synced, seq);
+            } else {
+                perror("Error syncing file");
+                atomic_store(&wb->failed, 1);
+            }
+        }
+        spscPush(&wb->freeBuffers, b);
+    }
+    return NULL;
+}
+
+// Hand the buffer being filled to the flush thread
+static void queue_current(WriteBehind *wb) {
+    wb->current->seq = ++wb->queued;
+    spscPush(&wb->fullBuffers, wb->current);
+    wb->current = NULL;
+}
+
+static void release(WriteBehind *wb) {
+    for (int i = 0; i < WB_BUFFERS; ++i) free(wb->buffers[i].data);
+    spscDestroy(&wb->freeBuffers);
+    spscDestroy(&wb->fullBuffers);
+    if (wb->fd >= 0) close(wb->fd);
+    free(wb);
+}
+
+WriteBehind *writeBehindOpen(const char *path, uint64_t preallocate, int direct, int keep) {
+    WriteBehind *wb = calloc(1, sizeof(WriteBehind));
+    if (!wb) return NULL;
+
+    int flags = O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC);
+    wb->fd = direct ? open(path, flags | O_DIRECT, 0644) : -1;
+    wb->direct = wb->fd >= 0;
+    if (wb->fd < 0) wb->fd = open(path, flags, 0644);
+    if (wb->fd < 0) {
+        free(wb);
+        return NULL;
+    }
+    struct stat st;
+    if (keep && fstat(wb->fd, &st) == 0) wb->end = st.st_size;
+    if (preallocate > 0) fallocate(wb->fd, 0, 0, preallocate);
+
+    if (spscInit(&wb->freeBuffers, WB_BUFFERS) < 0 || spscInit(&wb->fullBuffers, WB_BUFFERS) < 0) {
+        release(wb);
+        return NULL;
+    }
+    for (int i = 0; i < WB_BUFFERS; ++i) {
+        if (posix_memalign((void **)&wb->buffers[i].data, WB_ALIGN, WB_BUFFER_SIZE) != 0) {
+            wb->buffers[i].data = NULL;
+            release(wb);
+            return NULL;
+        }
+        spscPush(&wb->freeBuffers, &wb->buffers[i]);
+    }
+
+    if (pthread_create(&wb->thread, NULL, flush_thread, wb) != 0) {
+        release(wb);
+        return NULL;
+    }
+    return wb;
+}
+
+int writeBehindWrite(WriteBehind *wb, uint64_t offset, const unsigned char *data, int len) {
+    while (len > 0) {
+        WbBuffer *b = wb->current;
+        if (b && (offset != b->offset + b->len || b->len == WB_BUFFER_SIZE)) {
+            queue_current(wb);
+            b = NULL;
+        }
+        if (!b) {
+            b = wb->current = wb->nSpare > 0 ? wb->spare[--wb->nSpare] : spscPop(&wb->freeBuffers);
+            b->offset = offset;
+            b->len = 0;
+            b->last = 0;
+        }
+
+        int n = WB_BUFFER_SIZE - b->len;
+        if (n > len) n = len;
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+        offset += n;
+        data += n;
+        len -= n;
+        if (offset > wb->end) wb->end = offset;
+    }
+    return atomic_load(&wb->failed) ? -1 : 0;
+}
+
+uint64_t writeBehindMark(WriteBehind *wb, uint64_t *unsynced) {
+    *unsynced = UINT64_MAX;
+    if (wb->current && atomic_load(&wb->direct)) *unsynced = wb->current->offset;
+    else if (wb->current) queue_current(wb);
+    atomic_store(&wb->wanted, wb->queued);
+    return wb->queued;
+}
+
+int writeBehindDurable(WriteBehind *wb, uint64_t mark) {
+    if (atomic_load(&wb->failed)) return -1;
+    return atomic_load(&wb->synced) >= mark;
+}
+
+int writeBehindSync(WriteBehind *wb, uint64_t *unsynced) {
+    *unsynced = UINT64_MAX;
+    if (wb->current && atomic_load(&wb->direct)) *unsynced = wb->current->offset;
+    else if (wb->current) queue_current(wb);
+    while (wb->nSpare + (wb->current != NULL) < WB_BUFFERS) wb->spare[wb->nSpare++] = spscPop(&wb->freeBuffers);
+    if (atomic_load(&wb->failed) || fdatasync(wb->fd) != 0) return -1;
+    return 0;
+}
+
+int writeBehindClose(WriteBehind *wb, WriteBehindStats *stats) {
+    if (wb->current) {
+        wb->current->last = wb->current->offset + wb->current->len == wb->end;
+        queue_current(wb);
+    }
+    spscClose(&wb->fullBuffers);
+    pthread_join(wb->thread, NULL);
+
+    // Drop the O_DIRECT padding and any preallocation past the data
+    int result = atomic_load(&wb->failed) ? -1 : 0;
+    if (ftruncate(wb->fd, wb->end) != 0) result = -1;
+    if (stats) {
+        stats->bytes = wb->end;
+        stats->writes = wb->writes;
+        stats->direct = wb->direct;
+    }
+    release(wb);
+    return result;
+}
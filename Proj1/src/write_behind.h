@@ -0,0 +1,59 @@
+// Write-behind file output header.
+// Received data is copied into large buffers that a flush thread writes
+// to the file, so a slow disk does not hold up the loop that acknowledges
+// frames. Writes to consecutive offsets coalesce into one buffer.
+
+#ifndef _WRITE_BEHIND_H_
+#define _WRITE_BEHIND_H_
+
+#include <stdint.h>
+
+#define WB_BUFFER_SIZE (1024 * 1024)
+#define WB_BUFFERS 4      // Buffers filling or waiting to be flushed
+#define WB_ALIGN 4096     // O_DIRECT offset, length and memory alignment
+
+typedef struct WriteBehind WriteBehind;
+
+// Create (or truncate) the file at path; with keep, an existing file is
+// opened as it is, to be completed. When preallocate is not 0, that many
+// bytes are reserved with fallocate() so the file is laid out in one
+// piece; with direct, writes bypass the page cache (O_DIRECT) while they
+// stay aligned. Both fall back silently where the filesystem lacks them.
+// Returns NULL on error.
+WriteBehind *writeBehindOpen(const char *path, uint64_t preallocate, int direct, int keep);
+
+// Queue len bytes for offset, waiting only if every buffer is in flight.
+// Returns 0 on success or -1 if an earlier flush failed.
+int writeBehindWrite(WriteBehind *wb, uint64_t offset, const unsigned char *data, int len);
+
+// Ask for everything queued so far to be made durable (fdatasync) by the
+// flush thread once it is written, without waiting for it. With O_DIRECT
+// the buffer being filled is kept to stay aligned: its start goes to
+// *unsynced (UINT64_MAX when no byte is left out).
+// Returns a mark to pass to writeBehindDurable().
+uint64_t writeBehindMark(WriteBehind *wb, uint64_t *unsynced);
+
+// Returns 1 once what was queued before mark is on disk, 0 while it is not
+// yet, or -1 if a write or sync failed. Never waits. A mark taken when
+// no buffer was being filled may only be served once more data is queued.
+int writeBehindDurable(WriteBehind *wb, uint64_t mark);
+
+// Wait until everything queued so far is written and on disk (fdatasync).
+// With O_DIRECT the buffer being filled is kept to stay aligned: its start
+// goes to *unsynced (UINT64_MAX when every byte is on disk).
+// Returns 0 on success or -1 if any write failed.
+int writeBehindSync(WriteBehind *wb, uint64_t *unsynced);
+
+typedef struct
+{
+    uint64_t bytes;       // Size of the file written
+    unsigned long writes; // pwrite() calls
+    int direct;           // O_DIRECT held to the end
+} WriteBehindStats;
+
+// Flush everything, trim the file to the end of the data written and close
+// it, filling stats when it is not NULL.
+// Returns 0 on success or -1 if any write failed.
+int writeBehindClose(WriteBehind *wb, WriteBehindStats *stats);
+
+#endif // _WRITE_BEHIND_H_
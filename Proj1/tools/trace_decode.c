@@ -0,0 +1,126 @@
+// Print the link traces written by traceWrite() (src/trace.h) as text.
+// Usage: trace_decode <trace file>...
+// Each record (one per link closed) starts with its label and the
+// monotonic clock of its first event, so records of the two ends on one
+// machine can be lined up; event times are in ms from that first event.
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char *names[TrEventTypes] = {
+    [TrOpen] = "open",
+    [TrClose] = "close",
+    [TrSend] = "send",
+    [TrResend] = "resend",
+    [TrAccept] = "accept",
+    [TrDeliver] = "deliver",
+    [TrDuplicate] = "duplicate",
+    [TrBadFrame] = "bad-frame",
+    [TrRrSent] = "rr-sent",
+    [TrRejSent] = "rej-sent",
+    [TrRrReceived] = "rr-received",
+    [TrRejReceived] = "rej-received",
+    [TrTimeout] = "timeout",
+    [TrHarq] = "harq",
+};
+
+static void print_event(const TraceEvent *e, uint64_t t0)
+{
+    double ms = (double)(e->time - t0) / 1e6;
+    const char *name = e->type < TrEventTypes && names[e->type] ? names[e->type] : "?";
+    printf("%12.3f  %-12s", ms, name);
+    switch (e->type)
+    {
+    case TrOpen:
+        printf(" window %u, max payload %u\n", e->a, e->b);
+        break;
+    case TrClose:
+        printf(" %s\n", e->a ? "clean" : "failed");
+        break;
+    case TrSend:
+    case TrResend:
+    case TrAccept:
+    case TrDeliver:
+        printf(" seq %u, %u bytes\n", e->a, e->b);
+        break;
+    case TrBadFrame:
+        printf(" %u bytes\n", e->b);
+        break;
+    case TrRrReceived:
+        printf(" seq %u, %u bytes corrected\n", e->a, e->b);
+        break;
+    case TrTimeout:
+        printf(" seq %u, RTO %.1f ms\n", e->a, e->b / 1000.0);
+        break;
+    case TrHarq:
+        printf(" %u check bytes, frames of up to %u bytes\n", e->a, e->b);
+        break;
+    default:
+        printf(" seq %u\n", e->a);
+        break;
+    }
+}
+
+static int decode(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    TraceFileHeader h;
+    int result = 0;
+    while (fread(&h, sizeof(h), 1, f) == 1)
+    {
+        if (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 || h.eventSize != sizeof(TraceEvent))
+        {
+            fprintf(stderr, "%s: not a trace file\n", path);
+            result = -1;
+            break;
+        }
+        h.label[sizeof(h.label) - 1] = '\0';
+        TraceEvent e;
+        uint64_t t0 = 0;
+        printf("== %s: %u events", h.label, h.events);
+        if (h.recorded > h.events)
+            printf(" (%llu older ones overwritten)", (unsigned long long)(h.recorded - h.events));
+        for (uint32_t i = 0; i < h.events; ++i)
+        {
+            if (fread(&e, sizeof(e), 1, f) != 1)
+            {
+                fprintf(stderr, "%s: truncated\n", path);
+                fclose(f);
+                return -1;
+            }
+            if (i == 0)
+            {
+                t0 = e.time;
+                printf(", from %.6f s\n", t0 / 1e9);
+            }
+            print_event(&e, t0);
+        }
+        if (h.events == 0)
+            printf("\n");
+    }
+    fclose(f);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <trace file>...\n", argv[0]);
+        return 1;
+    }
+    int result = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (decode(argv[i]) < 0)
+            result = 1;
+    }
+    return result;
+}